@@ -1,5 +1,12 @@
+#include "src/Archive.h"
 #include "src/FileSystem.h"
+#include "src/Server.h"
+#include "src/Snapshot.h"
+#include <chrono>
+#include <csignal>
 #include <fstream>
+#include <iomanip>
+#include <map>
 #include <sstream>
 #include <vector>
 #include <iostream>
@@ -28,29 +35,232 @@ int parseNumericOption(const std::vector<std::string>& tokens, int defaultValue)
 	return defaultValue;
 }
 
+// Settings given on the memfs command line
+struct StartupOptions {
+	VirtualDiskOptions disk;
+	int numDisks = 1;
+	bool numaPerDisk = false; // Bind disk i to NUMA node i
+	std::string tierPath; // Spill file for cold files, none when empty
+	std::string socketPath; // Serve clients on this Unix socket instead of running the REPL
+	std::string shmName; // Disk i lives in the POSIX shm object "<shmName>.i" so clients can map it
+	bool batch = false; // Run commands without prompts or per-op messages and report timings
+	std::string scriptPath; // Batch input, stdin when empty or "-"
+	std::string tracePath; // Record every file operation here for the replay tool
+	std::string importPath; // Directory or .tar to load before accepting commands
+};
+
+// Disk geometry and placement flags: --blocks N --block-size N --hugepages
+// --hugetlb --numa-node N --numa-interleave --lazy-trim --disks N --numa-per-disk
+// --tier PATH --serve SOCKET --shm NAME --batch [SCRIPT] --trace PATH --import DIR|TAR
+StartupOptions parseStartupOptions(int argc, char* argv[]) {
+	StartupOptions options;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--blocks" && hasValue) {
+			options.disk.numBlocks = std::stoul(argv[++i]);
+		}
+		else if (arg == "--block-size" && hasValue) {
+			options.disk.blockSize = std::stoul(argv[++i]);
+		}
+		else if (arg == "--hugepages") {
+			options.disk.hugePages = true;
+		}
+		else if (arg == "--hugetlb") {
+			options.disk.hugeTlb = true;
+		}
+		else if (arg == "--numa-node" && hasValue) {
+			options.disk.numaNode = std::stoi(argv[++i]);
+		}
+		else if (arg == "--numa-interleave") {
+			options.disk.numaInterleave = true;
+		}
+		else if (arg == "--lazy-trim") {
+			options.disk.lazyTrim = true;
+		}
+		else if (arg == "--disks" && hasValue) {
+			options.numDisks = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--numa-per-disk") {
+			options.numaPerDisk = true;
+		}
+		else if (arg == "--tier" && hasValue) {
+			options.tierPath = argv[++i];
+		}
+		else if (arg == "--serve" && hasValue) {
+			options.socketPath = argv[++i];
+		}
+		else if (arg == "--shm" && hasValue) {
+			options.shmName = argv[++i];
+		}
+		else if (arg == "--import" && hasValue) {
+			options.importPath = argv[++i];
+		}
+		else if (arg == "--trace" && hasValue) {
+			options.tracePath = argv[++i];
+		}
+		else if (arg == "--batch") {
+			options.batch = true;
+			if (hasValue && argv[i + 1][0] != '-') {
+				options.scriptPath = argv[++i];
+			}
+		}
+		else {
+			std::cerr << "Ignoring unknown option: " << arg << "\n";
+		}
+	}
+	return options;
+}
+
+Server* activeServer = nullptr;
+
+void stopServer(int) {
+	activeServer->stop();
+}
+
+void importCommand(FileSystem& memFS, const std::string& source) {
+	auto start = std::chrono::steady_clock::now();
+	size_t imported = importFiles(memFS, source, std::thread::hardware_concurrency());
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Imported " << imported << " files from " << source << " in " << std::fixed
+		<< std::setprecision(3) << elapsed.count() << " s\n";
+}
+
+// Time spent per command name in batch mode
+struct CommandStats {
+	size_t count = 0;
+	std::chrono::nanoseconds total{0};
+};
+
+// Charges the time until the end of the scope to one command, whichever way
+// the command's branch is left
+struct CommandTimer {
+	CommandStats* stats;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	~CommandTimer() {
+		if (stats) {
+			++stats->count;
+			stats->total += std::chrono::steady_clock::now() - start;
+		}
+	}
+};
+
+void printCommandStats(const std::map<std::string, CommandStats>& stats, std::chrono::nanoseconds elapsed) {
+	size_t commands = 0;
+	std::cout << "Command\tCount\tTotal ms\tAvg us\n";
+	for (const auto& [name, entry] : stats) {
+		commands += entry.count;
+		std::cout << name << "\t" << entry.count << "\t" << std::fixed << std::setprecision(3)
+			<< entry.total.count() / 1e6 << "\t" << entry.total.count() / 1e3 / entry.count << "\n";
+	}
+	double seconds = elapsed.count() / 1e9;
+	std::cout << commands << " commands in " << std::fixed << std::setprecision(3) << seconds << " s ("
+		<< std::setprecision(0) << (seconds > 0 ? commands / seconds : 0) << " ops/s)\n";
+}
+
+// Runs until SIGINT or SIGTERM
+int serve(FileSystem& memFS, const std::string& socketPath, const std::string& shmName) {
+	try {
+		Server server(memFS, socketPath, shmName);
+		memFS.setVerbose(false);
+		activeServer = &server;
+		signal(SIGINT, stopServer);
+		signal(SIGTERM, stopServer);
+		server.run();
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		activeServer = nullptr;
+	} catch (const std::runtime_error& e) {
+		std::cerr << "Error: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
+
 // Command-line handling and testing of FileSystem
-int main() {
-	VirtualDisk vdisk;
-	FileSystem memFS(vdisk);
+int main(int argc, char* argv[]) {
+	StartupOptions options = parseStartupOptions(argc, argv);
+
+	// The block budget is split evenly over the striped disks
+	options.disk.numBlocks /= options.numDisks;
+	std::vector<std::unique_ptr<VirtualDisk>> disks;
+	std::vector<VirtualDisk*> diskPtrs;
+	for (int i = 0; i < options.numDisks; ++i) {
+		VirtualDiskOptions diskOptions = options.disk;
+		if (options.numaPerDisk) {
+			diskOptions.numaNode = i;
+		}
+		if (!options.shmName.empty()) {
+			diskOptions.shmName = options.shmName + "." + std::to_string(i);
+		}
+		disks.emplace_back(new VirtualDisk(diskOptions));
+		diskPtrs.push_back(disks.back().get());
+	}
+	FileSystem memFS(diskPtrs);
+	if (!options.tierPath.empty()) {
+		memFS.enableTiering(options.tierPath);
+	}
+	if (!options.tracePath.empty() && !memFS.startTrace(options.tracePath)) {
+		return 1;
+	}
+	if (!options.importPath.empty()) {
+		importCommand(memFS, options.importPath);
+	}
+	if (!options.socketPath.empty()) {
+		return serve(memFS, options.socketPath, options.shmName);
+	}
+	std::vector<std::unique_ptr<Snapshot>> snapshots;
 	std::string command;
 
+	std::ifstream script;
+	if (!options.scriptPath.empty() && options.scriptPath != "-") {
+		script.open(options.scriptPath);
+		if (!script) {
+			std::cerr << "Error: Cannot open " << options.scriptPath << "\n";
+			return 1;
+		}
+	}
+	std::istream& input = script.is_open() ? script : std::cin;
+	std::map<std::string, CommandStats> stats;
+	if (options.batch) {
+		memFS.setVerbose(false);
+	}
+	auto batchStart = std::chrono::steady_clock::now();
+
 	while (true) {
-		std::cout << "memfs> ";
-		std::getline(std::cin, command);
+		if (!options.batch) {
+			std::cout << "memfs> ";
+		}
+		if (!std::getline(input, command)) {
+			break;
+		}
 
 		std::vector<std::string> tokens = split(command);
-		if (tokens.empty()) {
-			std::cerr << "Invalid command: Empty command\n";
+		if (tokens.empty() || tokens[0][0] == '#') {
+			if (!options.batch) {
+				std::cerr << "Invalid command: Empty command\n";
+			}
 			continue;
 		}
 
 		std::string commandName = tokens[0];
+		CommandTimer timer{options.batch ? &stats[commandName] : nullptr};
 
 		if (commandName == "create") {
 			size_t numFiles = parseNumericOption(tokens, 1);
-			for (size_t i = tokens.size() - numFiles; i < tokens.size(); ++i) {
-				std::string filename = tokens[i];
-				memFS.createFile(filename);
+			if (numFiles == 1) {
+				memFS.createFile(tokens.back());
+				continue;
+			}
+			if (numFiles > tokens.size() - 3) { // Names follow "create -n <count>"
+				std::cerr << "Invalid command: Fewer filenames than -n asks for\n";
+				continue;
+			}
+			std::vector<std::string> filenames(tokens.end() - numFiles, tokens.end());
+			size_t created = memFS.createFiles(filenames);
+			if (!options.batch) {
+				std::cout << "Created " << created << " of " << numFiles << " files\n";
 			}
 		}
 		else if (commandName == "write") {
@@ -70,6 +280,10 @@ int main() {
 					continue;
 				}
 				numFiles = parseNumericOption(tokens, 2); // Parse the number of files
+				if (numFiles < 1) {
+					std::cerr << "Invalid command: Missing number of files or content\n";
+					continue;
+				}
 				contentStartIndex = 2 + (numFiles > 1 ? 1 : 0); // Adjust the index for content
 			}
 
@@ -79,22 +293,66 @@ int main() {
 				continue;
 			}
 
-			// Write to the specified number of files
-			for (int i = 0; i < numFiles; ++i) {
-				std::string filename = tokens[contentStartIndex + 2 * i]; // Get the filename
-				std::string content = tokens[contentStartIndex + 2 * i + 1]; // Get the corresponding content
+			if (numFiles == 1) {
+				std::string content = tokens[contentStartIndex + 1];
+				memFS.writeFile(tokens[contentStartIndex], std::vector<char>(content.begin(), content.end()));
+				continue;
+			}
 
-				std::vector<char> char_vector(content.begin(), content.end());
-				memFS.writeFile(filename, char_vector);
+			// Write every file in one batch, the contents stay in the tokens
+			std::vector<WriteRequest> writes;
+			writes.reserve(numFiles);
+			for (int i = 0; i < numFiles; ++i) {
+				const std::string& content = tokens[contentStartIndex + 2 * i + 1];
+				writes.push_back(WriteRequest{tokens[contentStartIndex + 2 * i], content.data(), content.size()});
+			}
+			size_t written = memFS.writeFiles(writes);
+			if (!options.batch) {
+				std::cout << "Wrote " << written << " of " << numFiles << " files\n";
 			}
 		}
 		else if (commandName == "delete") {
 			size_t numFiles = parseNumericOption(tokens, 1);
-			for (size_t i = tokens.size() - numFiles; i < tokens.size(); ++i) {
-				std::string filename = tokens[i];
-				memFS.deleteFile(filename);
+			if (numFiles == 1) {
+				memFS.deleteFile(tokens.back());
+				continue;
+			}
+			if (numFiles > tokens.size() - 3) { // Names follow "delete -n <count>"
+				std::cerr << "Invalid command: Fewer filenames than -n asks for\n";
+				continue;
+			}
+			std::vector<std::string> filenames(tokens.end() - numFiles, tokens.end());
+			size_t deleted = memFS.deleteFiles(filenames);
+			if (!options.batch) {
+				std::cout << "Deleted " << deleted << " of " << numFiles << " files\n";
 			}
 		}
+		else if (commandName == "import" || commandName == "export") {
+			if (tokens.size() < 2) {
+				std::cerr << "Invalid command: Missing directory or .tar path\n";
+				continue;
+			}
+			if (commandName == "import") {
+				importCommand(memFS, tokens[1]);
+			} else {
+				size_t exported = exportFiles(memFS, tokens[1], std::thread::hardware_concurrency());
+				std::cout << "Exported " << exported << " files to " << tokens[1] << "\n";
+			}
+		}
+		else if (commandName == "rename") {
+			if (tokens.size() < 3) {
+				std::cerr << "Invalid command: Missing old or new filename\n";
+				continue;
+			}
+			memFS.renameFile(tokens[1], tokens[2]);
+		}
+		else if (commandName == "clone") {
+			if (tokens.size() < 3) {
+				std::cerr << "Invalid command: Missing source or destination filename\n";
+				continue;
+			}
+			memFS.cloneFile(tokens[1], tokens[2]);
+		}
 		else if (commandName == "read") {
 			if (tokens.size() < 2) {
 				std::cerr << "Invalid command: Missing filename\n";
@@ -103,19 +361,92 @@ int main() {
 			std::string filename = tokens[1];
 			std::vector<char> char_vector;
 			memFS.readFile(filename, char_vector);
-			std::cout << std::string(char_vector.begin(), char_vector.end()) << std::endl;
+			if (!options.batch) {
+				std::cout << std::string(char_vector.begin(), char_vector.end()) << std::endl;
+			}
+		}
+		else if (commandName == "dedup") {
+			if (tokens.size() < 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+				std::cerr << "Invalid command: Expected dedup on|off\n";
+				continue;
+			}
+			memFS.setDedup(tokens[1] == "on");
+		}
+		else if (commandName == "compress") {
+			if (tokens.size() < 3 || (tokens[2] != "on" && tokens[2] != "off")) {
+				std::cerr << "Invalid command: Expected compress <filename> on|off\n";
+				continue;
+			}
+			memFS.setCompression(tokens[1], tokens[2] == "on");
+		}
+		else if (commandName == "verify") {
+			if (tokens.size() < 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+				std::cerr << "Invalid command: Expected verify on|off\n";
+				continue;
+			}
+			memFS.setVerifyOnRead(tokens[1] == "on");
+		}
+		else if (commandName == "scrub") {
+			std::vector<size_t> corrupt = memFS.scrub(std::thread::hardware_concurrency());
+			for (size_t blockIndex : corrupt) {
+				std::cout << "Block " << blockIndex << " is corrupt\n";
+			}
+			std::cout << "Scrub finished, " << corrupt.size() << " corrupt blocks\n";
+		}
+		else if (commandName == "trim") {
+			memFS.trim();
+		}
+		else if (commandName == "snapshot") {
+			snapshots.push_back(memFS.snapshot());
+			std::cout << "Snapshot id " << snapshots.size() - 1 << "\n";
+		}
+		else if (commandName == "snapread" || commandName == "snapls" || commandName == "snapdrop") {
+			if (tokens.size() < 2) {
+				std::cerr << "Invalid command: Missing snapshot id\n";
+				continue;
+			}
+			size_t id = snapshots.size();
+			try {
+				id = std::stoul(tokens[1]);
+			} catch (const std::logic_error&) {
+				// Not a number, so no such snapshot
+			}
+			if (id >= snapshots.size() || !snapshots[id]) {
+				std::cerr << "Invalid command: No snapshot " << tokens[1] << "\n";
+				continue;
+			}
+
+			if (commandName == "snapread") {
+				if (tokens.size() < 3) {
+					std::cerr << "Invalid command: Missing filename\n";
+					continue;
+				}
+				std::vector<char> char_vector;
+				if (snapshots[id]->readFile(tokens[2], char_vector)) {
+					std::cout << std::string(char_vector.begin(), char_vector.end()) << std::endl;
+				}
+			}
+			else if (commandName == "snapls") {
+				snapshots[id]->listFiles(tokens.size() > 2 && tokens[2] == "-l");
+			}
+			else {
+				snapshots[id].reset();
+			}
 		}
 		else if (commandName == "ls") {
 			bool detailed = tokens.size() > 1 && tokens[1] == "-l";
 			memFS.listFiles(detailed ? 1 : 0);
 		}
 		else if (commandName == "exit") {
-			exit(0);
+			break;
 		}
 		else {
 			std::cerr << "Invalid command: " << commandName << "\n";
 		}
 	}
 
+	if (options.batch) {
+		printCommandStats(stats, std::chrono::steady_clock::now() - batchStart);
+	}
 	return 0;
 }
\ No newline at end of file
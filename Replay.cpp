@@ -0,0 +1,170 @@
+#include "src/FileSystem.h"
+#include "src/Trace.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Replays a trace recorded with `memfs --trace` against a fresh filesystem:
+//   replay TRACE [--threads N] [--max-speed] [--blocks N] [--block-size N] [--disks N]
+// Recorded threads are spread over the replay threads by id, so calls made by
+// one thread keep their order. At original speed every call waits for its
+// recorded time; --max-speed issues them back to back.
+
+struct ReplayOptions {
+	std::string tracePath;
+	unsigned threads = 1;
+	bool maxSpeed = false;
+	VirtualDiskOptions disk;
+	int numDisks = 1;
+};
+
+static const char* opNames[] = {"", "create", "write", "writeat", "read", "delete", "rename", "clone", "compress"};
+#define NUM_TRACE_OPS 9
+
+bool parseReplayOptions(int argc, char* argv[], ReplayOptions& options) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--threads" && hasValue) {
+			options.threads = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--max-speed") {
+			options.maxSpeed = true;
+		}
+		else if (arg == "--blocks" && hasValue) {
+			options.disk.numBlocks = std::stoul(argv[++i]);
+		}
+		else if (arg == "--block-size" && hasValue) {
+			options.disk.blockSize = std::stoul(argv[++i]);
+		}
+		else if (arg == "--disks" && hasValue) {
+			options.numDisks = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (options.tracePath.empty()) {
+			options.tracePath = arg;
+		}
+		else {
+			std::cerr << "Ignoring unknown option: " << arg << "\n";
+		}
+	}
+	return !options.tracePath.empty();
+}
+
+void replayEvent(FileSystem& memFS, const TraceEvent& event, const std::vector<char>& filler) {
+	const TraceRecord& record = event.record;
+	switch (record.op) {
+	case TraceOp::Create:
+		memFS.createFile(event.name);
+		break;
+	case TraceOp::Write:
+		memFS.writeFile(event.name, std::vector<char>(filler.begin(), filler.begin() + record.size));
+		break;
+	case TraceOp::WriteAt:
+		memFS.writeFileAt(event.name, record.offset, std::vector<char>(filler.begin(), filler.begin() + record.size));
+		break;
+	case TraceOp::Read: {
+		std::vector<char> data;
+		memFS.readFile(event.name, data);
+		break;
+	}
+	case TraceOp::Delete:
+		memFS.deleteFile(event.name);
+		break;
+	case TraceOp::Rename:
+		memFS.renameFile(event.name, event.target);
+		break;
+	case TraceOp::Clone:
+		memFS.cloneFile(event.name, event.target);
+		break;
+	case TraceOp::Compress:
+		memFS.setCompression(event.name, record.size != 0);
+		break;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	ReplayOptions options;
+	if (!parseReplayOptions(argc, argv, options)) {
+		std::cerr << "Usage: replay TRACE [--threads N] [--max-speed] [--blocks N] [--block-size N] [--disks N]\n";
+		return 1;
+	}
+
+	std::vector<TraceEvent> events;
+	if (!loadTrace(options.tracePath, events)) {
+		std::cerr << "Error: " << options.tracePath << " is not a readable trace\n";
+		return 1;
+	}
+
+	options.disk.numBlocks /= options.numDisks;
+	std::vector<std::unique_ptr<VirtualDisk>> disks;
+	std::vector<VirtualDisk*> diskPtrs;
+	for (int i = 0; i < options.numDisks; ++i) {
+		disks.emplace_back(new VirtualDisk(options.disk));
+		diskPtrs.push_back(disks.back().get());
+	}
+	FileSystem memFS(diskPtrs);
+	memFS.setVerbose(false);
+
+	// Writes replay the recorded sizes with a filler pattern
+	size_t largestWrite = 0;
+	std::vector<std::vector<const TraceEvent*>> queues(options.threads);
+	for (const TraceEvent& event : events) {
+		if (event.record.op == TraceOp::Write || event.record.op == TraceOp::WriteAt) {
+			largestWrite = std::max<size_t>(largestWrite, event.record.size);
+		}
+		queues[event.record.thread % options.threads].push_back(&event);
+	}
+	std::vector<char> filler(largestWrite);
+	for (size_t i = 0; i < filler.size(); ++i) {
+		filler[i] = 'a' + i % 26;
+	}
+
+	// Latencies per thread and op, merged once every thread is done
+	std::vector<std::vector<std::vector<uint64_t>>> latencies(options.threads,
+		std::vector<std::vector<uint64_t>>(NUM_TRACE_OPS));
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < options.threads; ++t) {
+		workers.emplace_back([&, t]() {
+			for (const TraceEvent* event : queues[t]) {
+				if (!options.maxSpeed) {
+					std::this_thread::sleep_until(start + std::chrono::nanoseconds(event->record.timestamp));
+				}
+				auto begin = std::chrono::steady_clock::now();
+				replayEvent(memFS, *event, filler);
+				auto elapsed = std::chrono::steady_clock::now() - begin;
+				latencies[t][(size_t)event->record.op % NUM_TRACE_OPS].push_back(
+					std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+			}
+		});
+	}
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Op\tCount\tAvg us\tp50 us\tp99 us\n";
+	for (size_t op = 1; op < NUM_TRACE_OPS; ++op) {
+		std::vector<uint64_t> merged;
+		for (unsigned t = 0; t < options.threads; ++t) {
+			merged.insert(merged.end(), latencies[t][op].begin(), latencies[t][op].end());
+		}
+		if (merged.empty()) {
+			continue;
+		}
+		std::sort(merged.begin(), merged.end());
+		double total = 0;
+		for (uint64_t ns : merged) {
+			total += ns;
+		}
+		std::cout << opNames[op] << "\t" << merged.size() << "\t" << std::fixed << std::setprecision(3)
+			<< total / merged.size() / 1e3 << "\t" << merged[merged.size() / 2] / 1e3 << "\t"
+			<< merged[merged.size() * 99 / 100] / 1e3 << "\n";
+	}
+	std::cout << events.size() << " operations on " << options.threads << " threads in " << std::setprecision(3)
+		<< seconds << " s (" << std::setprecision(0) << (seconds > 0 ? events.size() / seconds : 0) << " ops/s)\n";
+	return 0;
+}
@@ -0,0 +1,505 @@
+#include "Archive.h"
+#include "FileReader.h"
+#include "FileWriter.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace fsys = std::filesystem;
+
+// POSIX ustar header, one 512 byte record
+struct TarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkName[100];
+    char magic[6];
+    char version[2];
+    char userName[32];
+    char groupName[32];
+    char devMajor[8];
+    char devMinor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+static_assert(sizeof(TarHeader) == 512, "Tar records are 512 bytes");
+
+static bool endsWith(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Contents read from the host, written to the filesystem in one batch
+class ImportBatch {
+private:
+    FileSystem& fs;
+    const phmap::flat_hash_set<std::string>& existing;
+    std::vector<std::string> names;
+    std::vector<size_t> offsets;
+    std::vector<char> contents;
+
+public:
+    size_t imported = 0;
+
+    ImportBatch(FileSystem& fs, const phmap::flat_hash_set<std::string>& existing) : fs(fs), existing(existing) {}
+
+    // Room for one more file of this size, flushing first if the batch is full
+    char* add(const std::string& name, size_t size) {
+        if (!names.empty() && (contents.size() + size > ARCHIVE_BATCH_BYTES || names.size() >= ARCHIVE_BATCH_FILES)) {
+            flush();
+        }
+        names.push_back(name);
+        offsets.push_back(contents.size());
+        contents.resize(contents.size() + size);
+        return contents.data() + offsets.back();
+    }
+
+    void drop() { // Undoes the last add
+        contents.resize(offsets.back());
+        names.pop_back();
+        offsets.pop_back();
+    }
+
+    void flush() {
+        std::vector<std::string> created;
+        std::vector<WriteRequest> writes;
+        writes.reserve(names.size());
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (existing.find(names[i]) == existing.end()) {
+                created.push_back(names[i]);
+            }
+            size_t end = i + 1 < names.size() ? offsets[i + 1] : contents.size();
+            writes.push_back(WriteRequest{names[i], contents.data() + offsets[i], end - offsets[i]});
+        }
+        fs.createFiles(created);
+        imported += fs.writeFiles(writes);
+        names.clear();
+        offsets.clear();
+        contents.clear();
+    }
+};
+
+static bool readHostFile(const std::string& path, char* data, size_t size) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = read(fd, data + done, size - done);
+        if (got <= 0) {
+            break;
+        }
+        done += got;
+    }
+    close(fd);
+    return done == size;
+}
+
+// Copies a file too large to batch through a writer, one buffer at a time.
+// read(buffer, size) fills the whole buffer or fails.
+template <typename Read>
+static bool streamFile(FileSystem& fs, const std::string& name, uint64_t size, Read read) {
+    std::unique_ptr<FileWriter> writer = fs.openWriter(name);
+    std::vector<char> buffer(std::min<uint64_t>(size, ARCHIVE_IO_BUFFER));
+    while (size) {
+        size_t chunk = std::min<uint64_t>(size, buffer.size());
+        if (!read(buffer.data(), chunk) || !writer->write(buffer.data(), chunk)) {
+            return false;
+        }
+        size -= chunk;
+    }
+    return writer->commit();
+}
+
+static bool streamHostFile(FileSystem& fs, const std::string& path, const std::string& name, uint64_t size) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool copied = streamFile(fs, name, size, [fd](char* data, size_t length) {
+        size_t done = 0;
+        while (done < length) {
+            ssize_t got = read(fd, data + done, length - done);
+            if (got <= 0) {
+                return false;
+            }
+            done += got;
+        }
+        return true;
+    });
+    close(fd);
+    return copied;
+}
+
+static size_t importDirectory(FileSystem& fs, const std::string& source, unsigned numThreads,
+                              const phmap::flat_hash_set<std::string>& existing) {
+    std::vector<std::pair<std::string, size_t>> files;
+    std::error_code error;
+    for (auto it = fsys::recursive_directory_iterator(source, error); !error && it != fsys::recursive_directory_iterator();
+         it.increment(error)) {
+        if (it->is_regular_file(error)) {
+            files.emplace_back(it->path().string(), it->file_size(error));
+        }
+    }
+    if (error) {
+        std::cout << "Error: Cannot read " << source << ": " << error.message() << "\n";
+    }
+
+    // Each worker reads its share of the files and writes them in batches
+    std::atomic<size_t> imported{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < numThreads; ++t) {
+        workers.emplace_back([&, t]() {
+            ImportBatch batch(fs, existing);
+            for (size_t i = t; i < files.size(); i += numThreads) {
+                std::string name = fsys::path(files[i].first).lexically_relative(source).generic_string();
+                if (files[i].second > ARCHIVE_BATCH_BYTES) {
+                    if (streamHostFile(fs, files[i].first, name, files[i].second)) {
+                        ++batch.imported;
+                    } else {
+                        std::cout << "Error: Cannot import " << files[i].first << "\n";
+                    }
+                    continue;
+                }
+                char* data = batch.add(name, files[i].second);
+                if (!readHostFile(files[i].first, data, files[i].second)) {
+                    std::cout << "Error: Cannot read " << files[i].first << "\n";
+                    batch.drop();
+                }
+            }
+            batch.flush();
+            imported += batch.imported;
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return imported;
+}
+
+static uint64_t parseTarNumber(const char* field, size_t length) {
+    // GNU base-256 for values that don't fit in octal
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        uint64_t value = field[0] & 0x7f;
+        for (size_t i = 1; i < length; ++i) {
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+        }
+        return value;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < length && field[i]; ++i) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+static std::string tarField(const char* field, size_t length) {
+    return std::string(field, strnlen(field, length));
+}
+
+// Finds "path=" among the "<len> key=value\n" records of a pax header
+static std::string paxPath(const std::vector<char>& pax) {
+    size_t pos = 0;
+    while (pos < pax.size()) {
+        size_t space = pos;
+        while (space < pax.size() && pax[space] != ' ') {
+            ++space;
+        }
+        size_t length = strtoul(std::string(pax.data() + pos, space - pos).c_str(), nullptr, 10);
+        if (length <= space - pos + 1 || pos + length > pax.size()) {
+            break;
+        }
+        std::string record(pax.data() + space + 1, length - (space - pos) - 2);
+        if (record.compare(0, 5, "path=") == 0) {
+            return record.substr(5);
+        }
+        pos += length;
+    }
+    return "";
+}
+
+static size_t importTar(FileSystem& fs, const std::string& source, const phmap::flat_hash_set<std::string>& existing) {
+    FILE* tar = fopen(source.c_str(), "rb");
+    if (!tar) {
+        std::cout << "Error: Cannot open " << source << "\n";
+        return 0;
+    }
+    setvbuf(tar, nullptr, _IOFBF, ARCHIVE_IO_BUFFER);
+
+    ImportBatch batch(fs, existing);
+    TarHeader header;
+    std::string longName; // From a preceding GNU 'L' or pax header
+    while (fread(&header, sizeof(header), 1, tar) == 1 && header.name[0]) {
+        uint64_t size = parseTarNumber(header.size, sizeof(header.size));
+        uint64_t padded = (size + 511) / 512 * 512;
+
+        if (header.type == 'L' || header.type == 'x') {
+            std::vector<char> extra(padded);
+            if (fread(extra.data(), 1, padded, tar) != padded) {
+                break;
+            }
+            extra.resize(size);
+            longName = header.type == 'L' ? std::string(extra.data(), strnlen(extra.data(), size)) : paxPath(extra);
+            continue;
+        }
+        if (header.type != '0' && header.type != '\0' && header.type != '7') {
+            fseeko(tar, padded, SEEK_CUR); // Directories, links and the like
+            longName.clear();
+            continue;
+        }
+
+        std::string name = longName;
+        if (name.empty()) {
+            std::string prefix = tarField(header.prefix, sizeof(header.prefix));
+            name = tarField(header.name, sizeof(header.name));
+            if (!prefix.empty()) {
+                name = prefix + "/" + name;
+            }
+        }
+        longName.clear();
+        while (name.compare(0, 2, "./") == 0) {
+            name.erase(0, 2);
+        }
+
+        if (size > ARCHIVE_BATCH_BYTES) {
+            bool copied = streamFile(fs, name, size, [tar](char* data, size_t length) {
+                return fread(data, 1, length, tar) == length;
+            });
+            if (!copied) {
+                std::cout << "Error: Cannot import " << name << " from " << source << "\n";
+                break;
+            }
+            ++batch.imported;
+            fseeko(tar, padded - size, SEEK_CUR);
+            continue;
+        }
+
+        char* data = batch.add(name, size);
+        if (fread(data, 1, size, tar) != size) {
+            batch.drop();
+            std::cout << "Error: " << source << " is truncated\n";
+            break;
+        }
+        fseeko(tar, padded - size, SEEK_CUR);
+    }
+    batch.flush();
+    fclose(tar);
+    return batch.imported;
+}
+
+size_t importFiles(FileSystem& fs, const std::string& source, unsigned numThreads) {
+    std::vector<std::string> names = fs.fileNames();
+    phmap::flat_hash_set<std::string> existing(names.begin(), names.end());
+    if (endsWith(source, ".tar")) {
+        return importTar(fs, source, existing);
+    }
+    return importDirectory(fs, source, std::max(1u, numThreads), existing);
+}
+
+// Keeps exported files inside the destination
+static bool safeName(const std::string& name) {
+    fsys::path path(name);
+    if (name.empty() || path.is_absolute()) {
+        return false;
+    }
+    for (const fsys::path& part : path) {
+        if (part == "..") {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const char* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t written = write(fd, data + done, size - done);
+        if (written <= 0) {
+            return false;
+        }
+        done += written;
+    }
+    return true;
+}
+
+// Copies one file out through its reader, a view at a time
+static bool exportHostFile(FileReader& reader, const fsys::path& path, const std::string& name) {
+    std::error_code error;
+    fsys::create_directories(path.parent_path(), error);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cout << "Error: Cannot write " << name << "\n";
+        return false;
+    }
+    uint64_t copied = 0;
+    bool written = true;
+    const char* data;
+    size_t size;
+    while (written && reader.next(data, size)) {
+        written = writeAll(fd, data, size);
+        copied += size;
+    }
+    if (close(fd) != 0) {
+        written = false;
+    }
+    if (!written) {
+        std::cout << "Error: Cannot write " << name << "\n";
+        return false;
+    }
+    if (copied != reader.size()) {
+        std::cout << "Error: Cannot read " << name << "\n";
+        return false;
+    }
+    return true;
+}
+
+static size_t exportDirectory(FileSystem& fs, const std::string& destination, unsigned numThreads,
+                              const std::vector<std::string>& names) {
+    std::atomic<size_t> exported{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < numThreads; ++t) {
+        workers.emplace_back([&, t]() {
+            // One file at a time through a reader, so no file is ever held whole
+            for (size_t i = t; i < names.size(); i += numThreads) {
+                std::unique_ptr<FileReader> reader = fs.openReader(names[i]);
+                if (!reader) {
+                    continue; // Deleted since the listing
+                }
+                if (exportHostFile(*reader, fsys::path(destination) / names[i], names[i])) {
+                    ++exported;
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return exported;
+}
+
+static void writeTarNumber(char* field, size_t length, uint64_t value) {
+    if (length == 12 && value >= (1ull << 33)) {
+        // Base-256, as GNU tar writes sizes of 8 GiB and up
+        memset(field, 0, length);
+        field[0] = static_cast<char>(0x80);
+        for (size_t i = length - 1; i > 0 && value; --i, value >>= 8) {
+            field[i] = static_cast<char>(value & 0xff);
+        }
+        return;
+    }
+    snprintf(field, length, "%0*llo", static_cast<int>(length - 1), static_cast<unsigned long long>(value));
+}
+
+static void writeTarHeader(FILE* tar, const std::string& name, uint64_t size, char type) {
+    TarHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.name, name.data(), std::min(name.size(), sizeof(header.name)));
+    writeTarNumber(header.mode, sizeof(header.mode), 0644);
+    writeTarNumber(header.uid, sizeof(header.uid), 0);
+    writeTarNumber(header.gid, sizeof(header.gid), 0);
+    writeTarNumber(header.size, sizeof(header.size), size);
+    writeTarNumber(header.mtime, sizeof(header.mtime), time(nullptr));
+    header.type = type;
+    memcpy(header.magic, "ustar ", 6);
+    memcpy(header.version, " ", 2);
+
+    memset(header.checksum, ' ', sizeof(header.checksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        sum += reinterpret_cast<const unsigned char*>(&header)[i];
+    }
+    snprintf(header.checksum, sizeof(header.checksum), "%06o", sum);
+    fwrite(&header, sizeof(header), 1, tar);
+}
+
+static void writeTarPadding(FILE* tar, uint64_t size) {
+    static const char zeros[512] = {};
+    fwrite(zeros, 1, (512 - size % 512) % 512, tar);
+}
+
+static size_t exportTar(FileSystem& fs, const std::string& destination, const std::vector<std::string>& names) {
+    FILE* tar = fopen(destination.c_str(), "wb");
+    if (!tar) {
+        std::cout << "Error: Cannot create " << destination << "\n";
+        return 0;
+    }
+    setvbuf(tar, nullptr, _IOFBF, ARCHIVE_IO_BUFFER);
+
+    // One file at a time through a reader, so no file is ever held whole
+    size_t exported = 0;
+    for (const std::string& name : names) {
+        std::unique_ptr<FileReader> reader = fs.openReader(name);
+        if (!reader) {
+            continue; // Deleted since the listing
+        }
+        if (name.size() > sizeof(TarHeader::name)) {
+            // GNU long name record ahead of the real header
+            writeTarHeader(tar, "././@LongLink", name.size() + 1, 'L');
+            fwrite(name.c_str(), 1, name.size() + 1, tar);
+            writeTarPadding(tar, name.size() + 1);
+        }
+        writeTarHeader(tar, name, reader->size(), '0');
+        uint64_t written = 0;
+        const char* data;
+        size_t size;
+        while (reader->next(data, size)) {
+            fwrite(data, 1, size, tar);
+            written += size;
+        }
+        if (written != reader->size()) {
+            // Keep the archive readable, the entry's size is already written
+            std::cout << "Error: Cannot read " << name << "\n";
+            static const char zeros[512] = {};
+            while (written < reader->size()) {
+                size_t fill = std::min<uint64_t>(sizeof(zeros), reader->size() - written);
+                fwrite(zeros, 1, fill, tar);
+                written += fill;
+            }
+            writeTarPadding(tar, written);
+            continue;
+        }
+        writeTarPadding(tar, written);
+        ++exported;
+    }
+
+    // Two zero records end the archive
+    static const char zeros[1024] = {};
+    fwrite(zeros, 1, sizeof(zeros), tar);
+    if (fclose(tar) != 0) {
+        std::cout << "Error: Cannot write " << destination << "\n";
+    }
+    return exported;
+}
+
+size_t exportFiles(FileSystem& fs, const std::string& destination, unsigned numThreads) {
+    std::vector<std::string> names = fs.fileNames();
+    names.erase(std::remove_if(names.begin(), names.end(), [](const std::string& name) {
+        if (!safeName(name)) {
+            std::cout << "Error: Skipping " << name << ", it would land outside the destination\n";
+            return true;
+        }
+        return false;
+    }), names.end());
+    std::sort(names.begin(), names.end());
+
+    if (endsWith(destination, ".tar")) {
+        return exportTar(fs, destination, names);
+    }
+    return exportDirectory(fs, destination, std::max(1u, numThreads), names);
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include "FileSystem.h"
+#include <string>
+
+#define ARCHIVE_BATCH_BYTES (64u << 20) // File contents gathered before one writeFiles call, larger files are streamed
+#define ARCHIVE_BATCH_FILES 4096
+#define ARCHIVE_IO_BUFFER (1u << 20) // stdio buffer for tar streams
+
+// Bulk copies between a FileSystem and the host. A source or destination
+// ending in ".tar" is a tar stream, anything else a directory. Files are named
+// by their path relative to the directory, or as stored in the archive.
+// Existing files are overwritten. Both return the number of files copied.
+size_t importFiles(FileSystem& fs, const std::string& source, unsigned numThreads);
+
+size_t exportFiles(FileSystem& fs, const std::string& destination, unsigned numThreads);
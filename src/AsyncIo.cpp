@@ -0,0 +1,279 @@
+#include "AsyncIo.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// No liburing dependency, the ring is driven through the raw syscalls
+static int ioUringSetup(unsigned entries, io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int ioUringRegister(int ringFd, unsigned opcode, void* arg, unsigned numArgs) {
+    return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, numArgs);
+}
+
+AsyncIo::AsyncIo(int fd, unsigned queueDepth) : fd(fd) {
+    if (!setupRing(queueDepth)) {
+        ringFd = -1;
+    }
+}
+
+AsyncIo::~AsyncIo() {
+    wait();
+    closeRing();
+}
+
+void AsyncIo::closeRing() {
+    if (ringFd < 0) {
+        return;
+    }
+    munmap(sqes, entries * sizeof(io_uring_sqe));
+    if (cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    munmap(sqRing, sqRingSize);
+    close(ringFd);
+    ringFd = -1;
+}
+
+bool AsyncIo::setupRing(unsigned queueDepth) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = ioUringSetup(queueDepth, &params);
+    if (ringFd < 0) {
+        return false; // Old kernel, or io_uring disabled by seccomp or sysctl
+    }
+
+    entries = params.sq_entries;
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) {
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        close(ringFd);
+        return false;
+    }
+    cqRing = sqRing;
+    if (!singleMap) {
+        cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+            close(ringFd);
+            return false;
+        }
+    }
+    sqes = mmap(nullptr, entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        munmap(sqRing, sqRingSize);
+        close(ringFd);
+        return false;
+    }
+
+    char* sq = (char*)sqRing;
+    char* cq = (char*)cqRing;
+    sqHead = (unsigned*)(sq + params.sq_off.head);
+    sqTail = (unsigned*)(sq + params.sq_off.tail);
+    sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned*)(sq + params.sq_off.array);
+    cqHead = (unsigned*)(cq + params.cq_off.head);
+    cqTail = (unsigned*)(cq + params.cq_off.tail);
+    cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    // Kernels from 5.1 to 5.5 have a ring but reject plain reads and writes
+    if (!probeOps()) {
+        closeRing();
+        return false;
+    }
+
+    slots.resize(entries);
+    freeSlots.reserve(entries);
+    for (unsigned i = entries; i > 0; --i) {
+        freeSlots.push_back(i - 1);
+    }
+    return true;
+}
+
+bool AsyncIo::probeOps() {
+    std::vector<char> buffer(sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = (io_uring_probe*)buffer.data();
+    if (ioUringRegister(ringFd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+        return false; // Probing arrived in 5.6 together with the ops themselves
+    }
+    for (unsigned op : {IORING_OP_READ, IORING_OP_WRITE}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void AsyncIo::abandonRing(int error) {
+    std::vector<bool> idle(entries, false);
+    for (unsigned slot : freeSlots) {
+        idle[slot] = true;
+    }
+    for (unsigned slot = 0; slot < entries; ++slot) {
+        if (!idle[slot]) {
+            completed.emplace_back(std::move(slots[slot].callback), -error);
+        }
+    }
+    freeSlots.clear();
+    inFlight = 0;
+    unsubmitted = 0;
+
+    // Closing the ring cancels whatever the kernel still had in flight
+    closeRing();
+}
+
+void AsyncIo::queue(unsigned slot) {
+    const Request& request = slots[slot];
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    io_uring_sqe* sqe = (io_uring_sqe*)sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = request.offset + request.done;
+    sqe->addr = (uint64_t)(uintptr_t)(request.buffer + request.done);
+    sqe->len = (uint32_t)(request.length - request.done);
+    sqe->user_data = slot;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++unsubmitted;
+}
+
+void AsyncIo::enter(unsigned minComplete) {
+    unsigned flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+    while (unsubmitted || minComplete) {
+        int submitted = ioUringEnter(ringFd, unsubmitted, minComplete, flags);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            // Waiting again would spin forever, so hand the requests back failed
+            abandonRing(errno);
+            return;
+        }
+        unsubmitted -= std::min<unsigned>(unsubmitted, submitted);
+        minComplete = 0;
+    }
+}
+
+size_t AsyncIo::reap() {
+    size_t finished = 0;
+    if (ringFd < 0) {
+        return finished; // Abandoned while entering
+    }
+    unsigned head = *cqHead;
+    while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe* cqe = (io_uring_cqe*)cqes + (head & *cqMask);
+        unsigned slot = (unsigned)cqe->user_data;
+        int result = cqe->res;
+        __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+
+        Request& request = slots[slot];
+        if (result > 0 && request.done + result < request.length) {
+            // Short transfer, carry on from where the kernel stopped
+            request.done += result;
+            queue(slot);
+            continue;
+        }
+
+        ssize_t total = result < 0 ? result : (ssize_t)(request.done + result);
+        Callback callback = std::move(request.callback);
+        freeSlots.push_back(slot);
+        --inFlight;
+        ++finished;
+        if (callback) {
+            callback(total);
+        }
+        if (ringFd < 0) {
+            break; // The callback's own submission abandoned the ring
+        }
+        head = *cqHead; // The callback may have submitted and reaped more
+    }
+    return finished;
+}
+
+void AsyncIo::submit(bool write, uint64_t offset, char* buffer, size_t length, Callback callback) {
+    // Ring full, make room by retiring at least one request
+    while (ringFd >= 0 && freeSlots.empty()) {
+        enter(1);
+        reap();
+    }
+
+    if (ringFd < 0) {
+        size_t done = 0;
+        ssize_t result = 0;
+        while (done < length) {
+            result = write ? pwrite(fd, buffer + done, length - done, offset + done)
+                           : pread(fd, buffer + done, length - done, offset + done);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                break;
+            }
+            done += result;
+        }
+        completed.emplace_back(std::move(callback), result < 0 ? -errno : (ssize_t)done);
+        return;
+    }
+
+    unsigned slot = freeSlots.back();
+    freeSlots.pop_back();
+    slots[slot] = Request{write, offset, buffer, length, 0, std::move(callback)};
+    ++inFlight;
+    queue(slot);
+}
+
+void AsyncIo::submitRead(uint64_t offset, char* buffer, size_t length, Callback callback) {
+    submit(false, offset, buffer, length, std::move(callback));
+}
+
+void AsyncIo::submitWrite(uint64_t offset, const char* buffer, size_t length, Callback callback) {
+    submit(true, offset, const_cast<char*>(buffer), length, std::move(callback));
+}
+
+size_t AsyncIo::poll() {
+    size_t finished = 0;
+    while (!completed.empty()) {
+        auto entry = std::move(completed.front());
+        completed.pop_front();
+        if (entry.first) {
+            entry.first(entry.second);
+        }
+        ++finished;
+    }
+    if (ringFd >= 0) {
+        enter(0);
+        finished += reap();
+    }
+    return finished;
+}
+
+void AsyncIo::wait() {
+    poll();
+    while (pending()) {
+        if (ringFd >= 0 && inFlight) {
+            enter(1);
+        }
+        poll();
+    }
+}
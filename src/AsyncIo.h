@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+#define ASYNC_IO_QUEUE_DEPTH 256
+
+// Positional reads and writes on a file descriptor that complete through
+// callbacks. Requests go through an io_uring when the kernel provides one, so a
+// single thread can keep up to ASYNC_IO_QUEUE_DEPTH of them in flight. When
+// io_uring is unavailable, lacks plain read and write ops, or fails later on,
+// each request runs synchronously with pread/pwrite and only its callback is
+// deferred, so callers see the same behaviour either way.
+// Not thread safe, callers serialize access.
+class AsyncIo {
+public:
+	typedef std::function<void(ssize_t)> Callback; // Bytes transferred, or -errno
+
+private:
+	struct Request {
+		bool write;
+		uint64_t offset;
+		char* buffer;
+		size_t length;
+		size_t done; // Bytes already transferred, short transfers are resubmitted
+		Callback callback;
+	};
+
+	int fd;
+	int ringFd = -1;
+	unsigned entries = 0;
+
+	// Shared ring state, mapped from the kernel
+	void* sqRing = nullptr;
+	void* cqRing = nullptr;
+	size_t sqRingSize = 0;
+	size_t cqRingSize = 0;
+	void* sqes = nullptr;
+	unsigned* sqHead = nullptr;
+	unsigned* sqTail = nullptr;
+	unsigned* sqMask = nullptr;
+	unsigned* sqArray = nullptr;
+	unsigned* cqHead = nullptr;
+	unsigned* cqTail = nullptr;
+	unsigned* cqMask = nullptr;
+	void* cqes = nullptr;
+
+	std::vector<Request> slots; // One per ring entry, indexed by user_data
+	std::vector<unsigned> freeSlots;
+	unsigned unsubmitted = 0; // Queued in the SQ but not yet passed to the kernel
+	size_t inFlight = 0;
+	std::deque<std::pair<Callback, ssize_t>> completed; // Fallback completions waiting for poll
+
+	bool setupRing(unsigned queueDepth);
+
+	bool probeOps(); // The ring supports IORING_OP_READ and IORING_OP_WRITE (kernel 5.6+)
+
+	void closeRing();
+
+	void abandonRing(int error); // Fails every request still in the ring and falls back to pread/pwrite
+
+	void queue(unsigned slot);
+
+	void enter(unsigned minComplete);
+
+	size_t reap();
+
+	void submit(bool write, uint64_t offset, char* buffer, size_t length, Callback callback);
+
+public:
+	AsyncIo(int fd, unsigned queueDepth = ASYNC_IO_QUEUE_DEPTH);
+
+	AsyncIo(const AsyncIo&) = delete;
+
+	AsyncIo& operator=(const AsyncIo&) = delete;
+
+	~AsyncIo(); // Waits for outstanding requests
+
+	bool usingIoUring() const { return ringFd >= 0; }
+
+	size_t pending() const { return inFlight + completed.size(); }
+
+	void submitRead(uint64_t offset, char* buffer, size_t length, Callback callback);
+
+	void submitWrite(uint64_t offset, const char* buffer, size_t length, Callback callback);
+
+	size_t poll(); // Runs the callbacks of finished requests without blocking
+
+	void wait(); // Blocks until every submitted request has run its callback
+};
@@ -0,0 +1,161 @@
+#include "BlockList.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Free pieces of each size class, linked through their first word
+class BlockSlab {
+private:
+    struct FreePiece {
+        FreePiece* next;
+    };
+
+    std::mutex mtx;
+    FreePiece* freeLists[BLOCK_LIST_SLAB_CLASSES] = {};
+    std::vector<std::unique_ptr<char[]>> slabs;
+
+public:
+    size_t* allocate(unsigned sizeClass) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!freeLists[sizeClass]) {
+            // Split a fresh slab into pieces of this class, classes bigger
+            // than a slab get one piece per slab
+            size_t pieceBytes = (BLOCK_LIST_SLAB_MIN << sizeClass) * sizeof(size_t);
+            size_t slabBytes = std::max<size_t>(BLOCK_SLAB_BYTES, pieceBytes);
+            slabs.emplace_back(new char[slabBytes]);
+            char* slab = slabs.back().get();
+            for (size_t offset = slabBytes / pieceBytes * pieceBytes; offset > 0; offset -= pieceBytes) {
+                FreePiece* piece = reinterpret_cast<FreePiece*>(slab + offset - pieceBytes);
+                piece->next = freeLists[sizeClass];
+                freeLists[sizeClass] = piece;
+            }
+        }
+        FreePiece* piece = freeLists[sizeClass];
+        freeLists[sizeClass] = piece->next;
+        return reinterpret_cast<size_t*>(piece);
+    }
+
+    void release(size_t* blocks, unsigned sizeClass) {
+        std::lock_guard<std::mutex> lock(mtx);
+        FreePiece* piece = reinterpret_cast<FreePiece*>(blocks);
+        piece->next = freeLists[sizeClass];
+        freeLists[sizeClass] = piece;
+    }
+};
+
+// Shared by every filesystem, and never destroyed so static inodes can still
+// free their lists at exit
+static BlockSlab& blockSlab() {
+    static BlockSlab* slab = new BlockSlab();
+    return *slab;
+}
+
+static unsigned sizeClassOf(size_t capacity) {
+    unsigned sizeClass = 0;
+    while ((size_t(BLOCK_LIST_SLAB_MIN) << sizeClass) < capacity) {
+        ++sizeClass;
+    }
+    return sizeClass;
+}
+
+// Capacities past the inline ones are powers of two, so each maps to one class
+static size_t* allocateBlocks(size_t capacity) {
+    unsigned sizeClass = sizeClassOf(capacity);
+    if (sizeClass < BLOCK_LIST_SLAB_CLASSES) {
+        return blockSlab().allocate(sizeClass);
+    }
+    return new size_t[capacity];
+}
+
+static void freeBlocks(size_t* blocks, size_t capacity) {
+    unsigned sizeClass = sizeClassOf(capacity);
+    if (sizeClass < BLOCK_LIST_SLAB_CLASSES) {
+        blockSlab().release(blocks, sizeClass);
+    } else {
+        delete[] blocks;
+    }
+}
+
+BlockList::BlockList(const BlockList& other) {
+    reserve(other.count);
+    std::memcpy(data(), other.data(), other.count * sizeof(size_t));
+    count = other.count;
+}
+
+BlockList::BlockList(BlockList&& other) noexcept : count(other.count), capacity(other.capacity) {
+    if (other.isInline()) {
+        std::memcpy(inlineBlocks, other.inlineBlocks, sizeof(inlineBlocks));
+    } else {
+        blocks = other.blocks;
+    }
+    other.count = 0;
+    other.capacity = BLOCK_LIST_INLINE;
+}
+
+BlockList& BlockList::operator=(const BlockList& other) {
+    if (this != &other) {
+        count = 0;
+        reserve(other.count);
+        std::memcpy(data(), other.data(), other.count * sizeof(size_t));
+        count = other.count;
+    }
+    return *this;
+}
+
+BlockList& BlockList::operator=(BlockList&& other) noexcept {
+    if (this != &other) {
+        release();
+        count = other.count;
+        capacity = other.capacity;
+        if (other.isInline()) {
+            std::memcpy(inlineBlocks, other.inlineBlocks, sizeof(inlineBlocks));
+        } else {
+            blocks = other.blocks;
+        }
+        other.count = 0;
+        other.capacity = BLOCK_LIST_INLINE;
+    }
+    return *this;
+}
+
+void BlockList::grow(size_t minCapacity) {
+    size_t newCapacity = BLOCK_LIST_SLAB_MIN;
+    while (newCapacity < minCapacity) {
+        newCapacity *= 2;
+    }
+    size_t* newBlocks = allocateBlocks(newCapacity);
+    std::memcpy(newBlocks, data(), count * sizeof(size_t));
+    if (!isInline()) {
+        freeBlocks(blocks, capacity);
+    }
+    blocks = newBlocks;
+    capacity = newCapacity;
+}
+
+void BlockList::release() {
+    if (!isInline()) {
+        freeBlocks(blocks, capacity);
+        capacity = BLOCK_LIST_INLINE;
+    }
+}
+
+void BlockList::resize(size_t newCount) {
+    reserve(newCount);
+    if (newCount > count) {
+        std::fill(data() + count, data() + newCount, 0);
+    }
+    count = newCount;
+}
+
+void BlockList::clear() {
+    release();
+    count = 0;
+}
+
+void BlockList::swap(BlockList& other) noexcept {
+    BlockList moved(std::move(other));
+    other = std::move(*this);
+    *this = std::move(moved);
+}
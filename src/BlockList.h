@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#define BLOCK_LIST_INLINE 2 // Block indices held in the inode itself
+#define BLOCK_LIST_SLAB_MIN 4 // Capacity of the smallest slab size class
+#define BLOCK_LIST_SLAB_CLASSES 16 // Power-of-two classes from BLOCK_LIST_SLAB_MIN, larger lists use the heap
+#define BLOCK_SLAB_BYTES (256u << 10) // Carved into equal pieces of one size class
+
+// The block indices of one file. Small files keep them inside the list, so an
+// inode costs no separate allocation. Longer lists take pieces from a shared,
+// size-classed slab allocator instead of the general heap, which keeps
+// millions of inodes from fragmenting it. Pieces go back to their class's
+// free list and are never returned to the OS.
+class BlockList {
+private:
+	size_t count = 0;
+	size_t capacity = BLOCK_LIST_INLINE;
+	union {
+		size_t inlineBlocks[BLOCK_LIST_INLINE];
+		size_t* blocks;
+	};
+
+	bool isInline() const { return capacity == BLOCK_LIST_INLINE; }
+
+	void grow(size_t minCapacity);
+
+	void release(); // Gives the storage back and returns to inline
+
+public:
+	BlockList() {}
+
+	BlockList(const BlockList& other);
+
+	BlockList(BlockList&& other) noexcept;
+
+	BlockList& operator=(const BlockList& other);
+
+	BlockList& operator=(BlockList&& other) noexcept;
+
+	~BlockList() { release(); }
+
+	size_t size() const { return count; }
+
+	bool empty() const { return count == 0; }
+
+	size_t* data() { return isInline() ? inlineBlocks : blocks; }
+
+	const size_t* data() const { return isInline() ? inlineBlocks : blocks; }
+
+	size_t* begin() { return data(); }
+
+	size_t* end() { return data() + count; }
+
+	const size_t* begin() const { return data(); }
+
+	const size_t* end() const { return data() + count; }
+
+	size_t& operator[](size_t k) { return data()[k]; }
+
+	size_t operator[](size_t k) const { return data()[k]; }
+
+	void push_back(size_t blockIndex) {
+		if (count == capacity) {
+			grow(count + 1);
+		}
+		data()[count++] = blockIndex;
+	}
+
+	void reserve(size_t minCapacity) {
+		if (minCapacity > capacity) {
+			grow(minCapacity);
+		}
+	}
+
+	void resize(size_t newCount); // New entries are 0
+
+	void clear(); // Also frees the storage
+
+	void swap(BlockList& other) noexcept;
+};
@@ -0,0 +1,60 @@
+#include "Crc32c.h"
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78u // Reflected Castagnoli polynomial
+
+struct Crc32cTable {
+    uint32_t entries[256];
+
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+static uint32_t crc32cPortable(const uint8_t* data, size_t size) {
+    static const Crc32cTable table;
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(const uint8_t* data, size_t size) {
+    uint64_t crc = ~0u;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+
+    uint32_t crc32 = static_cast<uint32_t>(crc);
+    for (; i < size; ++i) {
+        crc32 = _mm_crc32_u8(crc32, data[i]);
+    }
+    return ~crc32;
+}
+#endif
+
+uint32_t crc32c(const uint8_t* data, size_t size) {
+#if defined(__x86_64__)
+    static const bool hasSse42 = __builtin_cpu_supports("sse4.2");
+    if (hasSse42) {
+        return crc32cHardware(data, size);
+    }
+#endif
+    return crc32cPortable(data, size);
+}
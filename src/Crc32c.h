@@ -0,0 +1,7 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it
+// and falls back to a table driven implementation otherwise.
+uint32_t crc32c(const uint8_t* data, size_t size);
@@ -0,0 +1,286 @@
+#include "DiskPool.h"
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <thread>
+
+DiskPool::DiskPool(const std::vector<VirtualDisk*>& vdisks)
+    : blocksPerDisk(SIZE_MAX), blockSize(vdisks.at(0)->blockSize) {
+    for (VirtualDisk* vdisk : vdisks) {
+        if (vdisk->blockSize != blockSize) {
+            throw std::invalid_argument("Pooled disks must share a block size");
+        }
+        blocksPerDisk = std::min<size_t>(blocksPerDisk, vdisk->numBlocks);
+    }
+
+    // Striping needs every disk to hold the same number of blocks
+    for (VirtualDisk* vdisk : vdisks) {
+        disks.emplace_back(new DiskAllocator());
+        disks.back()->disk = vdisk;
+        disks.back()->bitmap.assign(blocksPerDisk, false);
+    }
+    numBlocks = blocksPerDisk * disks.size();
+    diskSize = numBlocks * blockSize;
+    unclaimedBlocks = numBlocks;
+}
+
+bool DiskPool::reserve(size_t count) {
+    size_t unclaimed = unclaimedBlocks.load();
+    do {
+        if (unclaimed < count) {
+            return false;
+        }
+    } while (!unclaimedBlocks.compare_exchange_weak(unclaimed, unclaimed - count));
+    return true;
+}
+
+void DiskPool::unreserve(size_t count) {
+    unclaimedBlocks.fetch_add(count);
+}
+
+StripeCursor DiskPool::startStripe() {
+    StripeCursor cursor;
+    cursor.disk = std::hash<std::thread::id>()(std::this_thread::get_id()) % disks.size();
+    return cursor;
+}
+
+size_t DiskPool::allocateOn(size_t disk, size_t count, size_t* blockIndices) {
+    // One lock and one scan for the whole run, picking up where the last
+    // allocation on this disk stopped
+    DiskAllocator& allocator = *disks[disk];
+    std::lock_guard<std::mutex> lock(allocator.mtx);
+    size_t taken = 0;
+    size_t start = allocator.cursor;
+    for (size_t n = 0; n < blocksPerDisk && taken < count && allocator.usedBlocks < blocksPerDisk; ++n) {
+        size_t i = (start + n) % blocksPerDisk;
+        if (!allocator.bitmap[i]) {
+            allocator.bitmap[i] = true;
+            ++allocator.usedBlocks;
+            allocator.cursor = i + 1;
+            blockIndices[taken++] = i * disks.size() + disk;
+        }
+    }
+    return taken;
+}
+
+size_t DiskPool::allocate(StripeCursor& cursor) {
+    size_t blockIndex;
+    allocate(cursor, 1, &blockIndex);
+    return blockIndex;
+}
+
+void DiskPool::allocate(StripeCursor& cursor, size_t count, size_t* blockIndices) {
+    // Fill up to a stripe on the current disk, so big files end up spread
+    // over every disk while small ones stay on the writer's own disk. The
+    // reservation guarantees enough free blocks, but a concurrent free and
+    // allocate can move one to a disk already passed over, so keep going round.
+    while (count) {
+        size_t wanted = std::min<size_t>(count, STRIPE_BLOCKS - cursor.filled);
+        size_t taken = allocateOn(cursor.disk, wanted, blockIndices);
+        blockIndices += taken;
+        count -= taken;
+        cursor.filled += taken;
+
+        // Stripe done or disk full, carry on with the next one
+        if (taken < wanted || cursor.filled == STRIPE_BLOCKS) {
+            cursor.disk = (cursor.disk + 1) % disks.size();
+            cursor.filled = 0;
+        }
+    }
+}
+
+void DiskPool::freeBlock(size_t blockIndex, bool keepReserved) {
+    DiskAllocator& allocator = *disks[blockIndex % disks.size()];
+    size_t local = blockIndex / disks.size();
+
+    std::lock_guard<std::mutex> lock(allocator.mtx);
+    allocator.bitmap[local] = false;
+    --allocator.usedBlocks;
+    allocator.pendingTrim.push_back(local);
+    if (!keepReserved) {
+        unclaimedBlocks.fetch_add(1);
+    }
+}
+
+void DiskPool::reset() {
+    for (auto& allocator : disks) {
+        std::lock_guard<std::mutex> lock(allocator->mtx);
+        std::fill(allocator->bitmap.begin(), allocator->bitmap.end(), false);
+        allocator->usedBlocks = 0;
+        allocator->cursor = 0;
+        allocator->pendingTrim.clear();
+        allocator->disk->trimBlocks(0, blocksPerDisk);
+    }
+    unclaimedBlocks = numBlocks;
+}
+
+void DiskPool::maybeTrim() {
+    for (auto& allocator : disks) {
+        std::lock_guard<std::mutex> lock(allocator->mtx);
+
+        // A large backlog skips the rate limit so bursts of deletes can't pin memory
+        auto now = std::chrono::steady_clock::now();
+        size_t pendingBytes = allocator->pendingTrim.size() * blockSize;
+        if (pendingBytes < TRIM_BATCH_BYTES ||
+            (pendingBytes < TRIM_BACKLOG_BYTES && now - allocator->lastTrim < std::chrono::milliseconds(TRIM_INTERVAL_MS))) {
+            continue;
+        }
+        allocator->lastTrim = now;
+        trimPending(*allocator);
+    }
+}
+
+void DiskPool::trim() {
+    for (auto& allocator : disks) {
+        std::lock_guard<std::mutex> lock(allocator->mtx);
+        allocator->pendingTrim.clear();
+
+        // Every free block is a candidate, not just the recently freed ones
+        for (size_t i = 0; i < blocksPerDisk; ++i) {
+            if (!allocator->bitmap[i]) {
+                allocator->pendingTrim.push_back(i);
+            }
+        }
+        trimPending(*allocator);
+        allocator->lastTrim = std::chrono::steady_clock::now();
+    }
+}
+
+void DiskPool::trimPending(DiskAllocator& allocator) {
+    // Group freed blocks by page; a page can only go back once all of its
+    // blocks are free, otherwise it waits until its neighbours are freed too
+    size_t perPage = allocator.disk->blocksPerPage;
+    std::vector<size_t> pages;
+    pages.reserve(allocator.pendingTrim.size());
+    for (size_t local : allocator.pendingTrim) {
+        pages.push_back(local / perPage);
+    }
+    allocator.pendingTrim.clear();
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    auto trimRun = [&](size_t firstPage, size_t pageCount) {
+        size_t first = firstPage * perPage;
+        allocator.disk->trimBlocks(first, std::min(pageCount * perPage, blocksPerDisk - first));
+    };
+
+    size_t runStart = 0, runLength = 0;
+    for (size_t page : pages) {
+        size_t first = page * perPage;
+        size_t last = std::min(first + perPage, blocksPerDisk);
+        bool pageFree = std::none_of(allocator.bitmap.begin() + first, allocator.bitmap.begin() + last,
+                                     [](bool used) { return used; });
+        if (!pageFree) {
+            continue;
+        }
+
+        if (runLength && page == runStart + runLength) {
+            ++runLength;
+            continue;
+        }
+        if (runLength) {
+            trimRun(runStart, runLength);
+        }
+        runStart = page;
+        runLength = 1;
+    }
+    if (runLength) {
+        trimRun(runStart, runLength);
+    }
+}
+
+template <typename Fn>
+void DiskPool::forEachRun(const size_t* blockIndices, size_t count, int onlyDisk, Fn fn) {
+    size_t stride = disks.size();
+    for (size_t i = 0; i < count; ) {
+        size_t run = 1;
+        while (i + run < count && blockIndices[i + run] == blockIndices[i] + run * stride) {
+            ++run;
+        }
+
+        size_t disk = blockIndices[i] % stride;
+        if (onlyDisk < 0 || static_cast<size_t>(onlyDisk) == disk) {
+            fn(*disks[disk]->disk, blockIndices[i] / stride, run, i);
+        }
+        i += run;
+    }
+}
+
+void DiskPool::readBlock(size_t blockIndex, uint8_t* buffer) {
+    disks[blockIndex % disks.size()]->disk->readBlock(blockIndex / disks.size(), buffer);
+}
+
+void DiskPool::readPartialBlock(size_t blockIndex, uint8_t* buffer, size_t length) {
+    disks[blockIndex % disks.size()]->disk->readPartialBlock(blockIndex / disks.size(), buffer, length);
+}
+
+void DiskPool::writeBlock(size_t blockIndex, const uint8_t* buffer) {
+    disks[blockIndex % disks.size()]->disk->writeBlock(blockIndex / disks.size(), buffer);
+}
+
+void DiskPool::writePartialBlock(size_t blockIndex, const uint8_t* buffer, size_t length) {
+    disks[blockIndex % disks.size()]->disk->writePartialBlock(blockIndex / disks.size(), buffer, length);
+}
+
+void DiskPool::readBlocks(const size_t* blockIndices, size_t count, uint8_t* buffer) {
+    auto readRun = [this, buffer](VirtualDisk& disk, size_t local, size_t run, size_t position) {
+        disk.readBlocks(local, run, buffer + position * blockSize);
+    };
+
+    if (count < PARALLEL_READ_BLOCKS || disks.size() == 1) {
+        forEachRun(blockIndices, count, -1, readRun);
+        return;
+    }
+
+    // Large reads: every disk copies its own share of the list concurrently
+    std::vector<std::thread> readers;
+    std::vector<std::exception_ptr> errors(disks.size());
+    for (size_t d = 1; d < disks.size(); ++d) {
+        readers.emplace_back([this, blockIndices, count, d, &readRun, &errors]() {
+            try {
+                forEachRun(blockIndices, count, static_cast<int>(d), readRun);
+            } catch (...) {
+                errors[d] = std::current_exception();
+            }
+        });
+    }
+    try {
+        forEachRun(blockIndices, count, 0, readRun);
+    } catch (...) {
+        errors[0] = std::current_exception();
+    }
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+
+    // Surface a checksum or range error from any reader to the caller
+    for (std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+void DiskPool::writeBlocks(const size_t* blockIndices, size_t count, const uint8_t* buffer) {
+    forEachRun(blockIndices, count, -1, [this, buffer](VirtualDisk& disk, size_t local, size_t run, size_t position) {
+        disk.writeBlocks(local, run, buffer + position * blockSize);
+    });
+}
+
+void DiskPool::setVerifyOnRead(bool enabled) {
+    for (auto& allocator : disks) {
+        allocator->disk->verifyOnRead = enabled;
+    }
+}
+
+std::vector<size_t> DiskPool::scrub(unsigned numThreads) {
+    std::vector<size_t> result;
+    for (size_t d = 0; d < disks.size(); ++d) {
+        for (size_t local : disks[d]->disk->scrub(numThreads)) {
+            if (local < blocksPerDisk) {
+                result.push_back(local * disks.size() + d);
+            }
+        }
+    }
+    return result;
+}
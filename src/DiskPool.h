@@ -0,0 +1,111 @@
+#pragma once
+#include "VirtualDisk.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define STRIPE_BLOCKS 256 // Blocks a writer takes from one disk before moving to the next
+#define PARALLEL_READ_BLOCKS 4096 // Reads this large fan out one thread per disk
+#define TRIM_BATCH_BYTES (1u << 20) // Freed bytes to accumulate before trimming
+#define TRIM_INTERVAL_MS 50 // Minimum time between two automatic trims
+#define TRIM_BACKLOG_BYTES (64u << 20) // Freed bytes that force a trim regardless of the interval
+
+// Where a writer is currently allocating from
+struct StripeCursor {
+	unsigned disk = 0;
+	size_t filled = 0;
+};
+
+// Stripes global block numbers across several VirtualDisks: block g lives on
+// disk g % N at local index g / N. Each disk has its own allocator and lock,
+// so writers that start on different disks never contend for a free block.
+// Writers reserve the blocks they need up front, so one that checked for room
+// can't be starved half way through by another taking the same free blocks.
+class DiskPool {
+private:
+	struct DiskAllocator {
+		VirtualDisk *disk;
+		std::mutex mtx;
+		std::vector<bool> bitmap; // Occupied local blocks
+		size_t usedBlocks = 0;
+		size_t cursor = 0; // Where the next free-block scan starts
+		std::vector<size_t> pendingTrim; // Freed local blocks not yet handed back to the OS
+		std::chrono::steady_clock::time_point lastTrim;
+	};
+
+	std::vector<std::unique_ptr<DiskAllocator>> disks;
+	size_t blocksPerDisk;
+	std::atomic<size_t> unclaimedBlocks; // Free blocks nobody has reserved
+
+	size_t allocateOn(size_t disk, size_t count, size_t* blockIndices); // Fewer than count once the disk is full
+
+	void trimPending(DiskAllocator& allocator);
+
+	// Calls fn(disk, localBlock, runLength, listPosition) for every run of list
+	// entries that are adjacent on the same disk; onlyDisk < 0 visits every disk
+	template <typename Fn>
+	void forEachRun(const size_t* blockIndices, size_t count, int onlyDisk, Fn fn);
+
+public:
+	uint32_t blockSize;
+	size_t numBlocks;
+	size_t diskSize;
+
+	DiskPool(const std::vector<VirtualDisk*>& disks);
+
+	size_t diskCount() const { return disks.size(); }
+
+	size_t freeBlocks() const { return unclaimedBlocks.load(std::memory_order_acquire); } // Not yet reserved
+
+	bool reserve(size_t count); // False, reserving nothing, if fewer blocks are free
+
+	void unreserve(size_t count); // Hands back the part of a reservation that wasn't allocated
+
+	StripeCursor startStripe(); // The first disk is picked from the calling thread
+
+	size_t allocate(StripeCursor& cursor); // Takes one block out of the caller's reservation
+
+	void allocate(StripeCursor& cursor, size_t count, size_t* blockIndices); // A run of blocks, same rules
+
+	void freeBlock(size_t blockIndex, bool keepReserved = false); // keepReserved adds it to the caller's reservation
+
+	void reset(); // Frees and trims every block
+
+	void maybeTrim(); // Trims once enough blocks were freed and the rate limit allows
+
+	void trim(); // Return every fully free page to the OS now
+
+	uint64_t blockVersion(size_t blockIndex) const {
+		return disks[blockIndex % disks.size()]->disk->block_versions[blockIndex / disks.size()].load(std::memory_order_acquire);
+	}
+
+	// Where a block lives in its disk's arena. Only safe to read while the
+	// caller holds a reference that keeps the block from being rewritten.
+	const uint8_t* blockAddress(size_t blockIndex) const {
+		const VirtualDisk* disk = disks[blockIndex % disks.size()]->disk;
+		return disk->vdisk + (blockIndex / disks.size()) * disk->blockSize;
+	}
+
+	bool adjacent(size_t blockIndex, size_t nextIndex) const { return nextIndex == blockIndex + disks.size(); } // Same disk, next local block
+
+	bool verifyingReads() const { return disks[0]->disk->verifyOnRead; }
+
+	void readBlock(size_t blockIndex, uint8_t* buffer);
+
+	void readPartialBlock(size_t blockIndex, uint8_t* buffer, size_t length);
+
+	void writeBlock(size_t blockIndex, const uint8_t* buffer);
+
+	void writePartialBlock(size_t blockIndex, const uint8_t* buffer, size_t length);
+
+	void readBlocks(const size_t* blockIndices, size_t count, uint8_t* buffer);
+
+	void writeBlocks(const size_t* blockIndices, size_t count, const uint8_t* buffer);
+
+	void setVerifyOnRead(bool enabled);
+
+	std::vector<size_t> scrub(unsigned numThreads); // Corrupt blocks as global indices
+};
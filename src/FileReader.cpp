@@ -0,0 +1,127 @@
+#include "FileReader.h"
+#include "Lz.h"
+
+FileReader::FileReader(FileSystem &fs, const std::string& fileName, const Inode& inode, uint64_t generation)
+    : fs(fs), fileName(fileName), inode(inode), generation(generation), direct(!fs.pool.verifyingReads()) {
+    prefetch(0);
+}
+
+FileReader::~FileReader() {
+    fs.releasePinned(inode, generation);
+}
+
+void FileReader::prefetch(size_t fromBlock) {
+    // Touch the start of what the following call will hand out, so its cache
+    // misses overlap with the caller working through the current view
+    size_t blockSize = fs.blockSize;
+    size_t budget = READER_PREFETCH_BYTES;
+    for (size_t k = fromBlock; k < inode.dataPtr.size() && budget >= blockSize; ++k, budget -= blockSize) {
+        const uint8_t* block = fs.pool.blockAddress(inode.dataPtr[k]);
+        for (size_t offset = 0; offset < blockSize; offset += CACHE_LINE_BYTES) {
+            __builtin_prefetch(block + offset);
+        }
+    }
+}
+
+bool FileReader::nextStored(const char*& data, size_t& size) {
+    if (storedPos >= inode.storedSize) {
+        return false;
+    }
+
+    if (inode.demoted) {
+        size = std::min<size_t>(READER_EXTENT_BYTES, inode.storedSize - storedPos);
+        buffer.resize(size);
+        if (!fs.tier->load(inode.tierOffset + storedPos, buffer.data(), size)) {
+            std::cout << "Error: Could not read " << fileName << " from the file tier\n";
+            return false;
+        }
+        data = buffer.data();
+        storedPos += size;
+        return true;
+    }
+
+    // Extend the extent while the next block follows on the same disk
+    size_t blockSize = fs.blockSize;
+    size_t first = nextBlock;
+    size_t count = 1;
+    while (first + count < inode.dataPtr.size() && (count + 1) * blockSize <= READER_EXTENT_BYTES &&
+           fs.pool.adjacent(inode.dataPtr[first + count - 1], inode.dataPtr[first + count])) {
+        ++count;
+    }
+    nextBlock += count;
+    size = std::min(count * blockSize, inode.storedSize - storedPos);
+    storedPos += size;
+
+    if (direct) {
+        data = reinterpret_cast<const char*>(fs.pool.blockAddress(inode.dataPtr[first]));
+    } else {
+        buffer.resize(count * blockSize);
+        try {
+            fs.pool.readBlocks(inode.dataPtr.data() + first, count, reinterpret_cast<uint8_t*>(buffer.data()));
+        } catch (const std::runtime_error& e) {
+            std::cout << "Error: Could not read " << fileName << ": " << e.what() << "\n";
+            return false;
+        }
+        data = buffer.data();
+    }
+    prefetch(nextBlock);
+    return true;
+}
+
+bool FileReader::gather(size_t size) {
+    while (frame.size() < size) {
+        if (pendingSize == 0 && !nextStored(pending, pendingSize)) {
+            return false;
+        }
+        size_t take = std::min(size - frame.size(), pendingSize);
+        frame.insert(frame.end(), pending, pending + take);
+        pending += take;
+        pendingSize -= take;
+    }
+    return true;
+}
+
+bool FileReader::next(const char*& data, size_t& size) {
+    if (!inode.compressed) {
+        return nextStored(data, size);
+    }
+
+    if (pendingSize == 0 && !nextStored(pending, pendingSize)) {
+        return false;
+    }
+
+    // Decode in place when the whole frame sits in the current extent, and
+    // only copy the frames that straddle two extents
+    const char* frameStart = pending;
+    size_t frameSize = 0;
+    uint32_t header[2];
+    if (pendingSize >= LZ_FRAME_HEADER) {
+        memcpy(header, pending, sizeof(header));
+        frameSize = LZ_FRAME_HEADER + (header[1] & ~LZ_FRAME_RAW);
+    }
+    if (frameSize && frameSize <= pendingSize) {
+        pending += frameSize;
+        pendingSize -= frameSize;
+    } else {
+        frame.clear();
+        if (!gather(LZ_FRAME_HEADER)) {
+            return false;
+        }
+        memcpy(header, frame.data(), sizeof(header));
+        frameSize = LZ_FRAME_HEADER + (header[1] & ~LZ_FRAME_RAW);
+        if (!gather(frameSize)) {
+            std::cout << "Error: Compressed data of " << fileName << " is corrupt\n";
+            return false;
+        }
+        frameStart = frame.data();
+    }
+
+    decoded.clear();
+    if (!lzDecompressFrames(frameStart, frameSize, decoded)) {
+        std::cout << "Error: Compressed data of " << fileName << " is corrupt\n";
+        return false;
+    }
+    data = decoded.data();
+    size = decoded.size();
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "FileSystem.h"
+
+#define READER_EXTENT_BYTES (256u << 10) // Longest view next() hands out
+#define READER_PREFETCH_BYTES (16u << 10) // Of the following blocks, prefetched as each view is handed out
+#define CACHE_LINE_BYTES 64
+
+// Walks a file's contents a piece at a time without copying it into one
+// buffer. Each next() returns a view of a run of blocks that sit next to each
+// other on one disk, pointing straight into the disk's memory when it can, or
+// one decoded frame of a compressed file. The reader holds a reference on the
+// file's blocks, like a snapshot, so it sees the contents as of openReader even
+// if the file is rewritten or deleted meanwhile. A view stays valid until the
+// next call.
+class FileReader {
+private:
+	FileSystem &fs;
+	std::string fileName;
+	Inode inode; // Pinned copy of the file's inode
+	uint64_t generation; // A mkfs since open already dropped the reference
+	bool direct; // Views point into the disks, false when reads must be verified
+	size_t nextBlock = 0; // First block not yet handed out
+	size_t storedPos = 0; // Stored bytes handed out so far
+	std::vector<char> buffer; // Copied extent when it can't be viewed in place
+	const char* pending = nullptr; // Stored bytes of a compressed file not yet decoded
+	size_t pendingSize = 0;
+	std::vector<char> frame; // One frame gathered across extents
+	std::vector<char> decoded;
+
+	FileReader(FileSystem &fs, const std::string& fileName, const Inode& inode, uint64_t generation);
+
+	bool nextStored(const char*& data, size_t& size); // Next extent of the stored bytes
+
+	void prefetch(size_t fromBlock);
+
+	bool gather(size_t size); // Fills frame up to size bytes
+
+	friend class FileSystem;
+
+public:
+	FileReader(const FileReader&) = delete;
+
+	FileReader& operator=(const FileReader&) = delete;
+
+	~FileReader();
+
+	bool next(const char*& data, size_t& size); // False at the end of the file or on a read error
+
+	size_t size() const { return inode.size; }
+};
@@ -1,29 +1,451 @@
 #include "FileSystem.h"
+#include "Snapshot.h"
+#include "Transaction.h"
+#include "FileWriter.h"
+#include "FileReader.h"
+#include "Lz.h"
 
 FileSystem::FileSystem(VirtualDisk &vdisk)
-    : vdisk(vdisk), blockSize(vdisk.blockSize), totalBlocks(vdisk.numBlocks), diskSize(vdisk.diskSize) {
-        fileTable.reserve(totalBlocks);
+    : FileSystem(std::vector<VirtualDisk*>{&vdisk}) {}
+
+FileSystem::FileSystem(const std::vector<VirtualDisk*>& disks)
+    : pool(disks), blockSize(pool.blockSize), totalBlocks(pool.numBlocks), diskSize(pool.diskSize),
+      refCount(totalBlocks, 0) {
+        // Large disks grow the table on demand instead of reserving a slot per block
+        fileTable.reserve(std::min<size_t>(totalBlocks, INITIAL_FILE_TABLE_SIZE));
     }
 
 void FileSystem::mkfs()
 {
+    // Wait for transactions to finish writing shadow blocks before the pool is reset
+    std::unique_lock<std::shared_mutex> staging(stagingMtx);
+    std::lock_guard<std::mutex> lock(mtx);
     fileTable.clear();
-    bitmap.reset();
+    std::fill(refCount.begin(), refCount.end(), 0);
+    fingerprints.clear();
+    pool.reset();
+    if (tier) {
+        tier->reset();
+    }
+    ++generation;
+}
+
+void FileSystem::setDedup(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    dedup = enabled;
+    if (enabled && blockFingerprint.empty()) {
+        // Only filesystems that dedup pay for the per-block hash array
+        blockFingerprint.assign(totalBlocks, 0);
+    }
+    if (verbose) {
+        std::cout << "Deduplication " << (enabled ? "enabled" : "disabled") << "\n";
+    }
+}
+
+size_t FileSystem::allocateBlock(StripeCursor& cursor) {
+    size_t blockIndex = pool.allocate(cursor);
+    refCount[blockIndex] = 1;
+    return blockIndex;
+}
+
+void FileSystem::allocateBlocks(StripeCursor& cursor, size_t count, size_t* blockIndices) {
+    pool.allocate(cursor, count, blockIndices);
+    for (size_t k = 0; k < count; ++k) {
+        refCount[blockIndices[k]] = 1;
+    }
+}
+
+uint8_t* FileSystem::scratchBlock(unsigned slot) {
+    // Grows once to the block size in use, after that writes never allocate
+    thread_local std::vector<uint8_t> scratch;
+    if (scratch.size() < SCRATCH_BLOCKS * blockSize) {
+        scratch.resize(SCRATCH_BLOCKS * blockSize);
+    }
+    return scratch.data() + slot * blockSize;
+}
+
+void FileSystem::retainBlock(size_t blockIndex) {
+    ++refCount[blockIndex];
+}
+
+void FileSystem::releaseBlock(size_t blockIndex, size_t* reserved) {
+    // The block only becomes free once the last inode sharing it lets go
+    if (--refCount[blockIndex] == 0) {
+        unindexBlock(blockIndex);
+        pool.freeBlock(blockIndex, reserved != nullptr);
+        if (reserved) {
+            ++*reserved;
+        }
+    }
+}
+
+void FileSystem::releaseBlocks(Inode& inode) {
+    for (size_t blockIndex : inode.dataPtr) {
+        releaseBlock(blockIndex);
+    }
+    inode.dataPtr.clear();
+}
+
+void FileSystem::trim() {
+    std::lock_guard<std::mutex> lock(mtx); // Keeps a scrub from seeing a block zeroed under it
+    pool.trim();
+}
+
+bool FileSystem::enableTiering(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mtx);
+    try {
+        tier.reset(new FileTier(path));
+    } catch (const std::runtime_error& e) {
+        std::cout << "Error: " << e.what() << "\n";
+        return false;
+    }
+    std::cout << "Cold files will spill to " << path << "\n";
+    return true;
+}
+
+bool FileSystem::startTrace(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mtx);
+    try {
+        trace.reset(new TraceRecorder(path));
+    } catch (const std::runtime_error& e) {
+        std::cout << "Error: " << e.what() << "\n";
+        return false;
+    }
+    if (verbose) {
+        std::cout << "Tracing file operations to " << path << "\n";
+    }
+    return true;
+}
+
+void FileSystem::stopTrace() {
+    std::lock_guard<std::mutex> lock(mtx);
+    trace.reset();
+}
+
+void FileSystem::makeRoom(size_t numBlocks, const Inode& keep) {
+    // Free some slack beyond the request so a full disk doesn't re-sort on every write
+    size_t target = std::min(totalBlocks, numBlocks + totalBlocks / TIER_DEMOTE_SLACK);
+
+    std::vector<Inode*> candidates;
+    for (auto& [name, inode] : fileTable) {
+        if (&inode == &keep || inode.demoted || inode.storedSize == 0) {
+            continue;
+        }
+        // Blocks shared with clones or snapshots have to stay where they are
+        bool exclusive = std::all_of(inode.dataPtr.begin(), inode.dataPtr.end(),
+                                     [this](size_t blockIndex) { return refCount[blockIndex] == 1; });
+        if (exclusive) {
+            candidates.push_back(&inode);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Inode* a, const Inode* b) { return a->lastAccessed < b->lastAccessed; });
+
+    for (Inode* inode : candidates) {
+        if (freeBlocks() >= target) {
+            break;
+        }
+        demote(*inode);
+    }
+}
+
+bool FileSystem::demote(Inode& inode) {
+    std::vector<char> stored;
+    if (!readStored(inode, stored)) {
+        return false;
+    }
+    return storeInTier(inode, stored.data(), stored.size());
+}
+
+bool FileSystem::storeInTier(Inode& inode, const char* data, size_t dataSize) {
+    uint64_t offset;
+    if (!tier->store(data, dataSize, offset)) {
+        return false;
+    }
+
+    releaseBlocks(inode);
+    if (inode.demoted) {
+        tier->release(inode.tierOffset);
+    }
+    inode.demoted = true;
+    inode.tierOffset = offset;
+    inode.storedSize = dataSize;
+    return true;
+}
+
+bool FileSystem::promote(Inode& inode) {
+    // Only come back if the blocks can be found, otherwise stay in the tier
+    size_t numBlocksNeeded = (inode.storedSize + blockSize - 1) / blockSize;
+    if (freeBlocks() < numBlocksNeeded) {
+        makeRoom(numBlocksNeeded, inode);
+    }
+    if (freeBlocks() < numBlocksNeeded) {
+        return false;
+    }
+
+    std::vector<char> stored;
+    if (!readStored(inode, stored)) {
+        return false;
+    }
+
+    // storeBlocks drops the tier extent once the blocks are written
+    return storeBlocks(inode, stored.data(), stored.size());
+}
+
+void FileSystem::setVerifyOnRead(bool enabled) {
+    pool.setVerifyOnRead(enabled);
+}
+
+std::vector<size_t> FileSystem::scrub(unsigned numThreads) {
+    // A block being written has its new bytes before its new CRC, so writers
+    // are held off for the whole pass. Staging writers hold stagingMtx shared,
+    // which is why it is taken exclusively here.
+    std::unique_lock<std::shared_mutex> staging(stagingMtx);
+    std::lock_guard<std::mutex> lock(mtx);
+    return pool.scrub(numThreads);
+}
+
+uint64_t FileSystem::hashBlock(const uint8_t* block) const {
+    phmap::phmap_mix<8> mix;
+    uint64_t hash = blockSize;
+    for (size_t i = 0; i + sizeof(uint64_t) <= blockSize; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, block + i, sizeof(word));
+        hash = mix(hash ^ word);
+    }
+    return hash;
+}
+
+size_t FileSystem::findDuplicate(const uint8_t* block, uint64_t fingerprint, uint8_t* scratch) {
+    auto it = fingerprints.find(fingerprint);
+    if (it == fingerprints.end()) {
+        return totalBlocks;
+    }
+
+    // The hash only nominates a candidate, the bytes have to match too. A
+    // candidate that fails its checksum is no good to share either.
+    try {
+        pool.readBlock(it->second, scratch);
+    } catch (const std::runtime_error&) {
+        return totalBlocks;
+    }
+    if (std::memcmp(scratch, block, blockSize) != 0) {
+        return totalBlocks;
+    }
+    return it->second;
+}
+
+void FileSystem::indexBlock(size_t blockIndex, uint64_t fingerprint) {
+    // On a hash collision the first block keeps the slot
+    if (fingerprints.try_emplace(fingerprint, blockIndex).second) {
+        blockFingerprint[blockIndex] = fingerprint;
+    }
+}
+
+void FileSystem::unindexBlock(size_t blockIndex) {
+    if (fingerprints.empty()) {
+        return;
+    }
+    auto it = fingerprints.find(blockFingerprint[blockIndex]);
+    if (it != fingerprints.end() && it->second == blockIndex) {
+        fingerprints.erase(it);
+    }
 }
 
 void FileSystem::createFile(const std::string& fileName) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Create, fileName, 0, 0);
+    }
     if (fileTable.find(fileName) != fileTable.end()) {
         std::cerr << "Error: " << fileName << " already exists\n";
         return;
     }
     
-	fileTable.insert_or_assign(fileName, Inode(fileName));
-    std::cout << "File " << fileName << " created successfully\n";
+	fileTable.insert_or_assign(fileName, Inode());
+    if (verbose) {
+        std::cout << "File " << fileName << " created successfully\n";
+    }
 }
 
 bool FileSystem::writeFile(const std::string& fileName, const std::vector<char>& data) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Write, fileName, 0, data.size());
+    }
+    auto it = fileTable.find(fileName);
+    if (it == fileTable.end()) {
+        std::cout << "File not found!" << std::endl;
+        return false;
+    }
+
+    StripeCursor cursor = pool.startStripe();
+    if (!writeInode(it->second, data.data(), data.size(), cursor)) {
+        return false;
+    }
+    if (verbose) {
+        std::cout << "Successfully written to " << fileName << "\n";
+    }
+    return true;
+}
+
+bool FileSystem::writeInode(Inode& inode, const char* data, size_t dataSize, StripeCursor& cursor) {
+    bool stored;
+    if (inode.compressed) {
+        thread_local std::vector<char> frames;
+        frames.clear();
+        lzCompressFrames(data, dataSize, frames);
+        stored = storeBlocks(inode, frames.data(), frames.size(), cursor);
+        if (frames.capacity() > SCRATCH_KEEP_BYTES) {
+            std::vector<char>().swap(frames);
+        }
+    } else {
+        stored = storeBlocks(inode, data, dataSize, cursor);
+    }
+    if (!stored) {
+        return false;
+    }
 
+    inode.size = dataSize;
+    inode.updateModifiedTime();
+    return true;
+}
+
+bool FileSystem::storeBlocks(Inode& inode, const char* data, size_t dataSize, StripeCursor& cursor) {
+    size_t numBlocksNeeded = (dataSize + blockSize - 1) / blockSize;
+
+    // Blocks this inode owns alone are overwritten in place, shared ones are
+    // copied on write into fresh blocks so the other owners keep their data.
+    // The block list is updated in place so a rewrite doesn't reallocate it.
+    BlockList& blocks = inode.dataPtr;
+    size_t oldBlocks = blocks.size();
+    size_t reusableBlocks = 0;
+    for (size_t k = 0; k < oldBlocks && k < numBlocksNeeded; ++k) {
+        if (refCount[blocks[k]] == 1) {
+            ++reusableBlocks;
+        }
+    }
+
+    // Spill cold files to the file tier before giving up
+    size_t reserved = numBlocksNeeded - reusableBlocks;
+    if (tier && freeBlocks() < reserved) {
+        makeRoom(reserved, inode);
+    }
+
+    // Early return if not enough free blocks. Staging writers take blocks
+    // without the lock, so the count is reserved rather than just checked.
+    if (!pool.reserve(reserved)) {
+        // Nothing left to demote, so the new contents go straight to the tier
+        if (tier && storeInTier(inode, data, dataSize)) {
+            return true;
+        }
+        std::cout << "Not enough free blocks to store the file content!" << std::endl;
+        return false;
+    }
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    blocks.reserve(numBlocksNeeded);
+
+    // Without dedup every block past the old end is new, so they are taken
+    // from the pool in one run and the loop only visits the existing ones
+    size_t visited = numBlocksNeeded;
+    if (!dedup) {
+        visited = std::min(numBlocksNeeded, oldBlocks);
+        if (numBlocksNeeded > oldBlocks) {
+            blocks.resize(numBlocksNeeded);
+            allocateBlocks(cursor, numBlocksNeeded - oldBlocks, blocks.data() + oldBlocks);
+            reserved -= numBlocksNeeded - oldBlocks;
+        }
+    }
+
+    for (size_t k = 0; k < visited; ++k) {
+        size_t chunkSize = std::min(blockSize, dataSize - k * blockSize);
+        const uint8_t* block = bytes + k * blockSize;
 
+        uint64_t fingerprint = 0;
+        size_t blockIndex = totalBlocks;
+        if (dedup) {
+            // Zero pad the tail so equal tails hash equal, full blocks are
+            // hashed where they are
+            if (chunkSize < blockSize) {
+                uint8_t* padded = scratchBlock(0);
+                std::copy(block, block + chunkSize, padded);
+                std::fill(padded + chunkSize, padded + blockSize, 0);
+                block = padded;
+            }
+            fingerprint = hashBlock(block);
+            blockIndex = findDuplicate(block, fingerprint, scratchBlock(1));
+        }
+
+        // Blocks freed along the way go into the reservation: a duplicate can
+        // be one of this file's later blocks, which then needs copying too
+        if (blockIndex != totalBlocks) {
+            // Identical content is already on disk, just take a reference
+            retainBlock(blockIndex);
+            if (k < oldBlocks) {
+                releaseBlock(blocks[k], &reserved);
+            }
+        } else {
+            if (k < oldBlocks && refCount[blocks[k]] == 1) {
+                blockIndex = blocks[k];
+                unindexBlock(blockIndex);
+            } else {
+                blockIndex = allocateBlock(cursor);
+                --reserved;
+                if (k < oldBlocks) {
+                    releaseBlock(blocks[k], &reserved);
+                }
+            }
+
+            // Dedup writes each block right away so later blocks can match it
+            if (dedup) {
+                pool.writeBlock(blockIndex, block);
+                indexBlock(blockIndex, fingerprint);
+            }
+        }
+
+        if (k < oldBlocks) {
+            blocks[k] = blockIndex;
+        } else {
+            blocks.push_back(blockIndex);
+        }
+    }
+
+    if (!dedup) {
+        // Full blocks go straight from the caller's data in one vectored
+        // write, the short tail block is padded on the disk itself
+        size_t fullBlocks = dataSize / blockSize;
+        pool.writeBlocks(blocks.data(), fullBlocks, bytes);
+        if (fullBlocks < numBlocksNeeded) {
+            pool.writePartialBlock(blocks[fullBlocks], bytes + fullBlocks * blockSize, dataSize - fullBlocks * blockSize);
+        }
+    }
+
+    // Drop the tail of the previous contents if the file shrank
+    pool.unreserve(reserved);
+    for (size_t k = numBlocksNeeded; k < oldBlocks; ++k) {
+        releaseBlock(blocks[k]);
+    }
+    if (oldBlocks > numBlocksNeeded) {
+        blocks.resize(numBlocksNeeded);
+    }
+
+    if (inode.demoted) {
+        tier->release(inode.tierOffset);
+        inode.demoted = false;
+    }
+
+    inode.storedSize = dataSize;
+    pool.maybeTrim();
+    return true;
+}
+
+bool FileSystem::writeFileAt(const std::string& fileName, size_t offset, const std::vector<char>& data) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::WriteAt, fileName, offset, data.size());
+    }
     auto it = fileTable.find(fileName);
     if (it == fileTable.end()) {
         std::cout << "File not found!" << std::endl;
@@ -31,98 +453,824 @@ bool FileSystem::writeFile(const std::string& fileName, const std::vector<char>&
     }
 
     Inode& inode = it->second;
-    size_t dataSize = data.size(); // In Bytes
-    size_t numBlocksNeeded = (dataSize + blockSize - 1) / blockSize;
+    if (offset > inode.size) {
+        std::cout << "Error: Offset " << offset << " is past the end of " << fileName << "\n";
+        return false;
+    }
+    if (data.empty()) {
+        return true;
+    }
+
+    size_t endOffset = offset + data.size();
+
+    // Compressed frames can't be patched in place and neither can a file
+    // that has to stay in the tier, so those are rebuilt
+    if (inode.compressed || (inode.demoted && !promote(inode))) {
+        std::vector<char> contents;
+        if (!readInode(inode, contents)) {
+            return false;
+        }
+        contents.resize(std::max(contents.size(), endOffset));
+        std::copy(data.begin(), data.end(), contents.begin() + offset);
+
+        size_t newSize = contents.size();
+        std::vector<char> frames;
+        if (inode.compressed) {
+            lzCompressFrames(contents.data(), contents.size(), frames);
+        } else {
+            frames.swap(contents);
+        }
+        if (!storeBlocks(inode, frames.data(), frames.size())) {
+            return false;
+        }
+
+        inode.size = newSize;
+        inode.updateModifiedTime();
+        if (verbose) {
+            std::cout << "Successfully written to " << fileName << "\n";
+        }
+        return true;
+    }
+
+    size_t firstBlock = offset / blockSize;
+    size_t lastBlock = (endOffset - 1) / blockSize;
+
+    // Shared blocks are copied before being modified and blocks past the end
+    // extend the file; everything else is patched in place
+    size_t numBlocksNeeded = 0;
+    for (size_t k = firstBlock; k <= lastBlock; ++k) {
+        if (k >= inode.dataPtr.size() || refCount[inode.dataPtr[k]] > 1) {
+            ++numBlocksNeeded;
+        }
+    }
+
+    // Only the first and last block can be covered partly. They are read
+    // into scratch up front, so a checksum failure leaves the file untouched.
+    auto partlyCovered = [&](size_t k) {
+        return k < inode.dataPtr.size() &&
+               std::min(endOffset, (k + 1) * blockSize) - std::max(offset, k * blockSize) != blockSize;
+    };
+    try {
+        if (partlyCovered(firstBlock)) {
+            pool.readBlock(inode.dataPtr[firstBlock], scratchBlock(0));
+        }
+        if (lastBlock != firstBlock && partlyCovered(lastBlock)) {
+            pool.readBlock(inode.dataPtr[lastBlock], scratchBlock(1));
+        }
+    } catch (const std::runtime_error& e) {
+        std::cout << "Error: " << fileName << ": " << e.what() << "\n";
+        return false;
+    }
 
-    // Early return if not enough free blocks
-    if (bitmap.size() - bitmap.count() < numBlocksNeeded) {
+    if (!pool.reserve(numBlocksNeeded)) {
         std::cout << "Not enough free blocks to store the file content!" << std::endl;
         return false;
     }
 
-    uint8_t* buffer = new uint8_t[blockSize];
-    size_t dataIndex = 0;
-    size_t remainingDataSize = dataSize;
-    inode.dataPtr.clear(); // Clear previous block pointers
+    // Partly covered blocks are patched in scratch, the rest go straight
+    // from the caller's data
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+    StripeCursor cursor = pool.startStripe();
 
-    for (size_t i = 0; i < totalBlocks && remainingDataSize > 0; ++i) {
-        if (!bitmap[i]) {  // If block is free
-            bitmap[i] = 1;  // Mark block as occupied
-            size_t chunkSize = std::min(blockSize, remainingDataSize);
+    for (size_t k = firstBlock; k <= lastBlock; ++k) {
+        size_t blockStart = k * blockSize;
+        size_t from = std::max(offset, blockStart);
+        size_t to = std::min(endOffset, blockStart + blockSize);
 
-            // Copy data to buffer and write to the block
-            std::copy(data.begin() + dataIndex, data.begin() + dataIndex + chunkSize, buffer);
-            vdisk.writeBlock(i, buffer);
+        // Past the end a block starts out as the data, zero padded
+        if (k >= inode.dataPtr.size()) {
+            inode.dataPtr.push_back(allocateBlock(cursor));
+            pool.writePartialBlock(inode.dataPtr[k], bytes + (from - offset), to - from);
+            continue;
+        }
 
-            // Update inode with the block index and data progress
-            inode.dataPtr.push_back(i);
-            dataIndex += chunkSize;
-            remainingDataSize -= chunkSize;
+        size_t oldBlock = inode.dataPtr[k];
+        bool whole = to - from == blockSize;
+        uint8_t* buffer = whole ? nullptr : scratchBlock(k == firstBlock ? 0 : 1);
+        if (refCount[oldBlock] > 1) {
+            inode.dataPtr[k] = allocateBlock(cursor);
+            releaseBlock(oldBlock);
+        } else {
+            unindexBlock(oldBlock);
+        }
+
+        if (whole) {
+            pool.writeBlock(inode.dataPtr[k], bytes + (from - offset));
+        } else {
+            std::copy(bytes + (from - offset), bytes + (to - offset), buffer + (from - blockStart));
+            pool.writeBlock(inode.dataPtr[k], buffer);
         }
     }
 
-    delete[] buffer;
+    inode.size = std::max(inode.size, endOffset);
+    inode.storedSize = inode.size;
+    inode.updateModifiedTime();
+    if (verbose) {
+        std::cout << "Successfully written to " << fileName << "\n";
+    }
+    return true;
+}
 
-    // Check if the write was complete
-    if (remainingDataSize > 0) {
-        std::cout << "Error: Not enough blocks to complete write for " << fileName << "\n";
+bool FileSystem::cloneFile(const std::string& srcName, const std::string& dstName) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Clone, srcName, 0, 0, dstName);
+    }
+    auto it = fileTable.find(srcName);
+    if (it == fileTable.end()) {
+        std::cout << "File not found!" << std::endl;
+        return false;
+    }
+    if (fileTable.find(dstName) != fileTable.end()) {
+        std::cerr << "Error: " << dstName << " already exists\n";
         return false;
     }
 
-    inode.size = dataSize;
-    inode.updateModifiedTime();
-    std::cout << "Successfully written to " << fileName << "\n";
+    // The clone shares every block with its source until one of them writes
+    Inode clone = it->second;
+    clone.createdAt = clone.lastModified = std::chrono::system_clock::now();
+    for (size_t blockIndex : clone.dataPtr) {
+        retainBlock(blockIndex);
+    }
+    if (clone.demoted) {
+        tier->retain(clone.tierOffset);
+    }
+
+    fileTable.insert_or_assign(dstName, std::move(clone));
+    if (verbose) {
+        std::cout << "File " << srcName << " cloned to " << dstName << " successfully\n";
+    }
     return true;
 }
 
 bool FileSystem::deleteFile(const std::string& fileName) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Delete, fileName, 0, 0);
+    }
+    auto it = fileTable.find(fileName);
+    if (it == fileTable.end()) {
+        std::cout << "Error: " << fileName << " does not exist\n";
+        return false;
+    }
 
-    
-
-    if (fileTable.erase(fileName)) {
+    freeInode(it->second);
+    fileTable.erase(it);
+    pool.maybeTrim();
+    if (verbose) {
         std::cout << "File " << fileName << " deleted successfully\n";
-        return true;
-    } else {
-        std::cout << "Error: " << fileName << " does not exist\n";
+    }
+    return true;
+}
+
+bool FileSystem::renameFile(const std::string& oldName, const std::string& newName) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Rename, oldName, 0, 0, newName);
+    }
+    if (fileTable.find(oldName) == fileTable.end()) {
+        std::cout << "Error: " << oldName << " does not exist\n";
+        return false;
+    }
+    if (fileTable.find(newName) != fileTable.end()) {
+        std::cout << "Error: " << newName << " already exists\n";
         return false;
     }
+
+    renameInode(oldName, newName);
+    if (verbose) {
+        std::cout << "File " << oldName << " renamed to " << newName << "\n";
+    }
+    return true;
+}
+
+void FileSystem::renameInode(const std::string& oldName, const std::string& newName) {
+    auto it = fileTable.find(oldName);
+    Inode inode = std::move(it->second);
+    fileTable.erase(it);
+    fileTable.emplace(newName, std::move(inode));
+}
+
+void FileSystem::freeInode(Inode& inode) {
+    releaseBlocks(inode);
+    if (inode.demoted) {
+        tier->release(inode.tierOffset);
+        inode.demoted = false;
+    }
+}
+
+size_t FileSystem::createFiles(const std::vector<std::string>& fileNames) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        for (const std::string& fileName : fileNames) {
+            trace->record(TraceOp::Create, fileName, 0, 0);
+        }
+    }
+    fileTable.reserve(fileTable.size() + fileNames.size());
+    size_t created = 0;
+    for (const std::string& fileName : fileNames) {
+        if (fileTable.try_emplace(fileName).second) {
+            ++created;
+        } else {
+            std::cerr << "Error: " << fileName << " already exists\n";
+        }
+    }
+    return created;
+}
+
+size_t FileSystem::writeFiles(const std::vector<WriteRequest>& writes) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        for (const WriteRequest& write : writes) {
+            trace->record(TraceOp::Write, write.fileName, 0, write.size);
+        }
+    }
+    StripeCursor cursor = pool.startStripe();
+    size_t written = 0;
+    for (const WriteRequest& write : writes) {
+        auto it = fileTable.find(write.fileName);
+        if (it == fileTable.end()) {
+            std::cout << "Error: " << write.fileName << " does not exist\n";
+            continue;
+        }
+        if (writeInode(it->second, write.data, write.size, cursor)) {
+            ++written;
+        }
+    }
+    return written;
+}
+
+size_t FileSystem::deleteFiles(const std::vector<std::string>& fileNames) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        for (const std::string& fileName : fileNames) {
+            trace->record(TraceOp::Delete, fileName, 0, 0);
+        }
+    }
+    size_t deleted = 0;
+    for (const std::string& fileName : fileNames) {
+        auto it = fileTable.find(fileName);
+        if (it == fileTable.end()) {
+            std::cout << "Error: " << fileName << " does not exist\n";
+            continue;
+        }
+        freeInode(it->second);
+        fileTable.erase(it);
+        ++deleted;
+    }
+    pool.maybeTrim();
+    return deleted;
+}
+
+size_t FileSystem::readFiles(const std::vector<std::string>& fileNames, std::vector<std::vector<char>>& data) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        for (const std::string& fileName : fileNames) {
+            trace->record(TraceOp::Read, fileName, 0, 0);
+        }
+    }
+    data.resize(fileNames.size());
+    size_t found = 0;
+    for (size_t i = 0; i < fileNames.size(); ++i) {
+        data[i].clear();
+        auto it = fileTable.find(fileNames[i]);
+        if (it == fileTable.end()) {
+            std::cout << "Error: " << fileNames[i] << " does not exist\n";
+            continue;
+        }
+        Inode& inode = it->second;
+        if (inode.demoted) {
+            promote(inode);
+        }
+        inode.updateAccessTime();
+        if (readInode(inode, data[i])) {
+            ++found;
+        }
+    }
+    return found;
 }
 
 void FileSystem::readFile(const std::string& fileName, std::vector<char>& data) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Read, fileName, 0, 0);
+    }
     auto it = fileTable.find(fileName);
     if (it == fileTable.end()) {
         std::cout << "File not found!" << std::endl;
         return;
     }
 
+    // Promotion is best effort, a file that doesn't fit is read from the tier
+    Inode& inode = it->second;
+    if (inode.demoted) {
+        promote(inode);
+    }
+    inode.updateAccessTime();
+
+    if (!readInode(inode, data)) {
+        return;
+    }
+    if (verbose) {
+        std::cout << "Successfully read from " << fileName << "\n";
+    }
+}
+
+ThreadPool& FileSystem::asyncPool() {
+    std::lock_guard<std::mutex> lock(workersMtx);
+    if (!workers) {
+        workers.reset(new ThreadPool(ASYNC_WORKERS));
+    }
+    return *workers;
+}
+
+std::future<void> FileSystem::createFileAsync(std::string fileName) {
+    return asyncPool().submit([this, fileName = std::move(fileName)]() {
+        createFile(fileName);
+    });
+}
+
+std::future<bool> FileSystem::writeFileAsync(std::string fileName, std::vector<char> data) {
+    return asyncPool().submit([this, fileName = std::move(fileName), data = std::move(data)]() {
+        return writeFile(fileName, data);
+    });
+}
+
+std::future<bool> FileSystem::writeFileAtAsync(std::string fileName, size_t offset, std::vector<char> data) {
+    return asyncPool().submit([this, fileName = std::move(fileName), offset, data = std::move(data)]() {
+        return writeFileAt(fileName, offset, data);
+    });
+}
+
+std::future<bool> FileSystem::deleteFileAsync(std::string fileName) {
+    return asyncPool().submit([this, fileName = std::move(fileName)]() {
+        return deleteFile(fileName);
+    });
+}
+
+std::future<std::vector<char>> FileSystem::readFileAsync(std::string fileName) {
+    return asyncPool().submit([this, fileName = std::move(fileName)]() {
+        std::vector<char> data;
+        readFile(fileName, data);
+        return data;
+    });
+}
+
+bool FileSystem::copyStored(const Inode& inode, char* dst) {
+    if (inode.demoted) {
+        if (!tier->load(inode.tierOffset, dst, inode.storedSize)) {
+            std::cout << "Error: Could not read a file back from the file tier\n";
+            return false;
+        }
+        return true;
+    }
+
+    // One vectored read of the full blocks, the tail block only up to the end.
+    // With verify on read a corrupt block throws, which fails just this read.
+    size_t fullBlocks = inode.storedSize / blockSize;
+    try {
+        pool.readBlocks(inode.dataPtr.data(), fullBlocks, reinterpret_cast<uint8_t*>(dst));
+        size_t tailSize = inode.storedSize - fullBlocks * blockSize;
+        if (tailSize) {
+            pool.readPartialBlock(inode.dataPtr[fullBlocks], reinterpret_cast<uint8_t*>(dst) + fullBlocks * blockSize, tailSize);
+        }
+    } catch (const std::runtime_error& e) {
+        std::cout << "Error: Could not read a file: " << e.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool FileSystem::readStored(const Inode& inode, std::vector<char>& stored) {
+    stored.resize(inode.storedSize);
+    return copyStored(inode, stored.data());
+}
+
+bool FileSystem::readInodeInto(const Inode& inode, char* dst) {
+    if (!inode.compressed) {
+        return copyStored(inode, dst);
+    }
+
+    // Frames are decoded straight into place, the buffer holding them is
+    // kept per thread so steady reads don't allocate
+    thread_local std::vector<char> frames;
+    bool stored = readStored(inode, frames);
+    bool decoded = stored && lzDecompressFramesInto(frames.data(), frames.size(), dst, inode.size);
+    if (frames.capacity() > SCRATCH_KEEP_BYTES) {
+        std::vector<char>().swap(frames);
+    }
+    if (!stored) {
+        return false;
+    }
+    if (!decoded) {
+        std::cout << "Error: Compressed file data is corrupt\n";
+        return false;
+    }
+    return true;
+}
+
+bool FileSystem::readInode(const Inode& inode, std::vector<char>& data) {
+    data.resize(inode.size);
+    if (!readInodeInto(inode, data.data())) {
+        data.clear();
+        return false;
+    }
+    return true;
+}
+
+bool FileSystem::setCompression(const std::string& fileName, bool enabled) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Compress, fileName, 0, enabled);
+    }
+    auto it = fileTable.find(fileName);
+    if (it == fileTable.end()) {
+        std::cout << "File not found!" << std::endl;
+        return false;
+    }
 
-    const Inode& inode = it->second;
-    data.clear();
+    Inode& inode = it->second;
+    if (inode.compressed != enabled) {
+        // Re-encode whatever the file already holds in the new format
+        std::vector<char> contents, encoded;
+        if (!readInode(inode, contents)) {
+            return false;
+        }
+        if (enabled) {
+            lzCompressFrames(contents.data(), contents.size(), encoded);
+        } else {
+            encoded.swap(contents);
+        }
+
+        inode.compressed = enabled;
+        if (!storeBlocks(inode, encoded.data(), encoded.size())) {
+            inode.compressed = !enabled;
+            return false;
+        }
+    }
+
+    if (verbose) {
+        std::cout << "Compression " << (enabled ? "enabled" : "disabled") << " for " << fileName << "\n";
+    }
+    return true;
+}
+
+std::unique_ptr<Snapshot> FileSystem::snapshot() {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    // Every block gains a reference held by the snapshot, so later writes to
+    // the live files copy those blocks instead of modifying them in place
+    for (const auto& [name, inode] : fileTable) {
+        for (size_t blockIndex : inode.dataPtr) {
+            retainBlock(blockIndex);
+        }
+        if (inode.demoted) {
+            tier->retain(inode.tierOffset);
+        }
+    }
+
+    if (verbose) {
+        std::cout << "Snapshot of " << fileTable.size() << " files taken\n";
+    }
+    return std::unique_ptr<Snapshot>(new Snapshot(*this, fileTable, generation));
+}
+
+void FileSystem::releaseSnapshot(flat_hash_map<std::string, Inode>& files, uint64_t snapshotGeneration) {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    // mkfs already dropped every reference the snapshot was holding
+    if (snapshotGeneration != generation) {
+        return;
+    }
+    for (auto& [name, inode] : files) {
+        releaseBlocks(inode);
+        if (inode.demoted) {
+            tier->release(inode.tierOffset);
+        }
+    }
+    pool.maybeTrim();
+}
+
+std::unique_ptr<FileReader> FileSystem::openReader(const std::string& fileName) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Read, fileName, 0, 0);
+    }
+    auto it = fileTable.find(fileName);
+    if (it == fileTable.end()) {
+        std::cout << "File not found!" << std::endl;
+        return nullptr;
+    }
 
-    uint8_t* buffer = new uint8_t[blockSize];
-    size_t remainingSize = inode.size;
+    Inode& inode = it->second;
+    if (inode.demoted) {
+        promote(inode);
+    }
+    inode.updateAccessTime();
 
+    // Pinned the way a snapshot pins, writes to the file copy these blocks
     for (size_t blockIndex : inode.dataPtr) {
-        vdisk.readBlock(blockIndex, buffer);
-        size_t chunkSize = std::min(blockSize, remainingSize);
-        data.insert(data.end(), buffer, buffer + chunkSize);
+        retainBlock(blockIndex);
+    }
+    if (inode.demoted) {
+        tier->retain(inode.tierOffset);
+    }
+    return std::unique_ptr<FileReader>(new FileReader(*this, fileName, inode, generation));
+}
+
+void FileSystem::releasePinned(Inode& inode, uint64_t pinGeneration) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (pinGeneration != generation) {
+        return;
+    }
+    releaseBlocks(inode);
+    if (inode.demoted) {
+        tier->release(inode.tierOffset);
+    }
+    pool.maybeTrim();
+}
+
+std::unique_ptr<Transaction> FileSystem::beginTransaction() {
+    std::shared_lock<std::shared_mutex> staging(stagingMtx);
+    return std::unique_ptr<Transaction>(new Transaction(*this, generation));
+}
+
+std::unique_ptr<FileWriter> FileSystem::openWriter(const std::string& fileName) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = fileTable.find(fileName);
+    bool compressed = it != fileTable.end() && it->second.compressed;
+    return std::unique_ptr<FileWriter>(new FileWriter(*this, fileName, generation, compressed));
+}
+
+bool FileSystem::stageBlocks(Inode& shadow, const char* data, size_t dataSize, uint64_t txGeneration) {
+    // Only the pool's per-disk locks are taken. The blocks stay unreferenced,
+    // and so invisible to every file, until the commit publishes them
+    std::shared_lock<std::shared_mutex> staging(stagingMtx);
+    if (txGeneration != generation) {
+        return false;
+    }
+
+    size_t numBlocksNeeded = (dataSize + blockSize - 1) / blockSize;
+    if (!pool.reserve(numBlocksNeeded)) {
+        for (size_t staged : shadow.dataPtr) {
+            pool.freeBlock(staged);
+        }
+        shadow.dataPtr.clear();
+        std::cout << "Not enough free blocks to store the file content!" << std::endl;
+        return false;
+    }
+
+    StripeCursor cursor = pool.startStripe();
+    size_t firstBlock = shadow.dataPtr.size();
+    shadow.dataPtr.resize(firstBlock + numBlocksNeeded);
+    pool.allocate(cursor, numBlocksNeeded, shadow.dataPtr.data() + firstBlock);
+
+    size_t fullBlocks = dataSize / blockSize;
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    pool.writeBlocks(shadow.dataPtr.data() + firstBlock, fullBlocks, bytes);
+    if (fullBlocks < numBlocksNeeded) {
+        pool.writePartialBlock(shadow.dataPtr[firstBlock + fullBlocks], bytes + fullBlocks * blockSize,
+                               dataSize - fullBlocks * blockSize);
+    }
+
+    shadow.size += dataSize;
+    shadow.storedSize += dataSize;
+    return true;
+}
+
+void FileSystem::discardStaged(Inode& shadow, uint64_t txGeneration) {
+    std::shared_lock<std::shared_mutex> staging(stagingMtx);
+
+    // mkfs already handed the shadow blocks back to the pool
+    if (txGeneration == generation) {
+        for (size_t blockIndex : shadow.dataPtr) {
+            pool.freeBlock(blockIndex);
+        }
+    }
+    shadow.dataPtr.clear();
+}
+
+bool FileSystem::commitTransaction(Transaction& tx) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (tx.generation != generation) {
+        std::cout << "Error: The filesystem was reformatted during the transaction\n";
+        return false;
+    }
+
+    // Check every operation against the table as the earlier ones leave it,
+    // so nothing is applied unless all of them can be
+    flat_hash_map<std::string, bool> staged;
+    auto exists = [&](const std::string& name) {
+        auto it = staged.find(name);
+        return it != staged.end() ? it->second : fileTable.find(name) != fileTable.end();
+    };
+    for (const Transaction::Op& op : tx.ops) {
+        bool valid = op.type == Transaction::OpType::Create ? !exists(op.fileName) : exists(op.fileName);
+        if (op.type == Transaction::OpType::Rename && exists(op.newName)) {
+            std::cout << "Error: " << op.newName << " already exists\n";
+            return false;
+        }
+        if (!valid) {
+            std::cout << "Error: " << op.fileName << (exists(op.fileName) ? " already exists\n" : " does not exist\n");
+            return false;
+        }
+
+        if (op.type == Transaction::OpType::Create) {
+            staged[op.fileName] = true;
+        } else if (op.type == Transaction::OpType::Delete) {
+            staged[op.fileName] = false;
+        } else if (op.type == Transaction::OpType::Rename) {
+            staged[op.fileName] = false;
+            staged[op.newName] = true;
+        }
+    }
+
+    // A replay applies the operations one by one, in commit order
+    StripeCursor cursor = pool.startStripe();
+    for (Transaction::Op& op : tx.ops) {
+        if (trace) {
+            static const TraceOp traceOps[] = {TraceOp::Create, TraceOp::Write, TraceOp::Delete, TraceOp::Rename}; // In OpType order
+            trace->record(traceOps[static_cast<int>(op.type)], op.fileName, 0, op.shadow.size, op.newName);
+        }
+        switch (op.type) {
+        case Transaction::OpType::Create:
+            fileTable.try_emplace(op.fileName);
+            break;
+        case Transaction::OpType::Write: {
+            Inode& inode = fileTable.at(op.fileName);
+            for (size_t blockIndex : op.shadow.dataPtr) {
+                refCount[blockIndex] = 1;
+            }
+            if (inode.compressed) {
+                // Shadow blocks hold raw bytes, a compressed file re-encodes them
+                std::vector<char> raw, frames;
+                bool read = readStored(op.shadow, raw);
+                if (read) {
+                    lzCompressFrames(raw.data(), raw.size(), frames);
+                }
+                if (read && storeBlocks(inode, frames.data(), frames.size(), cursor)) {
+                    releaseBlocks(op.shadow);
+                    inode.size = raw.size();
+                    inode.updateModifiedTime();
+                    break;
+                }
+                // Out of space or unreadable, keep the raw shadow rather than fail half way through
+                inode.compressed = false;
+            }
+            freeInode(inode);
+            inode.dataPtr.swap(op.shadow.dataPtr);
+            inode.storedSize = op.shadow.storedSize;
+            inode.size = op.shadow.size;
+            inode.updateModifiedTime();
+            break;
+        }
+        case Transaction::OpType::Delete: {
+            auto it = fileTable.find(op.fileName);
+            freeInode(it->second);
+            fileTable.erase(it);
+            break;
+        }
+        case Transaction::OpType::Rename:
+            renameInode(op.fileName, op.newName);
+            break;
+        }
+    }
+
+    pool.maybeTrim();
+    if (verbose) {
+        std::cout << "Transaction of " << tx.ops.size() << " operations committed\n";
+    }
+    return true;
+}
+
+bool FileSystem::commitWriter(FileWriter& writer) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (writer.generation != generation) {
+        std::cout << "Error: The filesystem was reformatted while " << writer.fileName << " was being written\n";
+        return false;
+    }
+    auto [it, created] = fileTable.try_emplace(writer.fileName);
+    if (trace) {
+        if (created) {
+            trace->record(TraceOp::Create, writer.fileName, 0, 0);
+        }
+        trace->record(TraceOp::Write, writer.fileName, 0, writer.rawSize);
+    }
+
+    // The stored bytes are already in their final form, compressed or not,
+    // so the commit only swaps block lists
+    Inode& inode = it->second;
+    for (size_t blockIndex : writer.shadow.dataPtr) {
+        refCount[blockIndex] = 1;
+    }
+    freeInode(inode);
+    inode.dataPtr.swap(writer.shadow.dataPtr);
+    inode.storedSize = writer.shadow.storedSize;
+    inode.size = writer.rawSize;
+    inode.compressed = writer.compressed;
+    inode.updateModifiedTime();
+    pool.maybeTrim();
+    if (verbose) {
+        std::cout << "Successfully written to " << writer.fileName << "\n";
+    }
+    return true;
+}
 
-        // Update remaining size
-        remainingSize -= chunkSize;
-        if (remainingSize == 0) break;
+bool FileSystem::readFileInto(const std::string& fileName, char* buffer, size_t capacity, size_t& size) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Read, fileName, 0, 0);
+    }
+    size = 0;
+    auto it = fileTable.find(fileName);
+    if (it == fileTable.end()) {
+        std::cout << "Error: " << fileName << " does not exist\n";
+        return false;
     }
 
-    delete[] buffer;
-    std::cout << "Successfully read from " << fileName << "\n";
+    Inode& inode = it->second;
+    size = inode.size;
+    if (size > capacity) {
+        return false;
+    }
+    if (inode.demoted) {
+        promote(inode);
+    }
+    inode.updateAccessTime();
+    return readInodeInto(inode, buffer);
+}
+
+bool FileSystem::readFileInto(const std::string& fileName, std::vector<char>& data, size_t offset) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Read, fileName, 0, 0);
+    }
+    auto it = fileTable.find(fileName);
+    if (it == fileTable.end()) {
+        std::cout << "Error: " << fileName << " does not exist\n";
+        data.resize(offset);
+        return false;
+    }
+
+    Inode& inode = it->second;
+    if (inode.demoted) {
+        promote(inode);
+    }
+    inode.updateAccessTime();
+    data.resize(offset + inode.size);
+    return readInodeInto(inode, data.data() + offset);
 }
 
 void FileSystem::listFiles(bool detailed) {
+    std::lock_guard<std::mutex> lock(mtx);
+    printFiles(fileTable, detailed);
+}
+
+std::vector<std::string> FileSystem::fileNames() {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<std::string> names;
+    names.reserve(fileTable.size());
+    for (const auto& [name, inode] : fileTable) {
+        names.push_back(name);
+    }
+    return names;
+}
+
+bool FileSystem::locateFile(const std::string& fileName, FileLocation& location) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (trace) {
+        trace->record(TraceOp::Read, fileName, 0, 0);
+    }
+    auto it = fileTable.find(fileName);
+    if (it == fileTable.end()) {
+        return false;
+    }
+
+    Inode& inode = it->second;
+    if (inode.demoted) {
+        promote(inode);
+    }
+    inode.updateAccessTime();
+
+    location.size = inode.size;
+    location.storedSize = inode.storedSize;
+    location.compressed = inode.compressed;
+    location.demoted = inode.demoted;
+    location.blocks.assign(inode.dataPtr.begin(), inode.dataPtr.end());
+    location.versions.resize(inode.dataPtr.size());
+    for (size_t k = 0; k < inode.dataPtr.size(); ++k) {
+        location.versions[k] = pool.blockVersion(inode.dataPtr[k]);
+    }
+    return true;
+}
+
+void FileSystem::printFiles(const flat_hash_map<std::string, Inode>& files, bool detailed) {
     if(detailed)
     {
-        std::cout << "Size" << "\t" << "Created On" << "\t" 
+        std::cout << "Size" << "\t" << "Ratio" << "\t" << "Tier" << "\t" << "Created On" << "\t" 
                       << "Modifies" << "\t" << "File Name" << std::endl;
     }
-    for (const auto& [name, inode] : fileTable) {
+    for (const auto& [name, inode] : files) {
 
         if (detailed) {
             // Convert chrono::time_point to time_t
@@ -134,10 +1282,14 @@ void FileSystem::listFiles(bool detailed) {
             createdStream << std::put_time(std::localtime(&createdTime), "%Y-%m-%d");
             modifiedStream << std::put_time(std::localtime(&modifiedTime), "%Y-%m-%d");
 
-            std::cout << inode.size << "\t" << createdStream.str() << "\t" 
-                      << modifiedStream.str() << "\t" << inode.fileName << std::endl;
+            // Logical bytes per stored byte, 1.00 for uncompressed files
+            double ratio = inode.storedSize ? static_cast<double>(inode.size) / inode.storedSize : 1.0;
+
+            std::cout << inode.size << "\t" << std::fixed << std::setprecision(2) << ratio << "\t"
+                      << (inode.demoted ? "file" : "memory") << "\t" << createdStream.str() << "\t" 
+                      << modifiedStream.str() << "\t" << name << std::endl;
         }else{
             std::cout << name << "\n";
         }
     }
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -1,6 +1,9 @@
 #pragma once
-#include "VirtualDisk.h"
+#include "DiskPool.h"
 #include "Schema.h"
+#include "FileTier.h"
+#include "ThreadPool.h"
+#include "Trace.h"
 #include <bitset>
 #include <unordered_map>
 #include "../lib/parallel_hashmap/phmap.h"
@@ -8,37 +11,219 @@
 #include <iostream>
 #include <algorithm>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
 #include <atomic>
+#include <memory>
+#include <future>
 
-#define MAX_NUM_FILES 16000
+#define INITIAL_FILE_TABLE_SIZE 16384
+#define TIER_DEMOTE_SLACK 32 // Demotion frees an extra 1/32 of the disk beyond what was asked
+#define ASYNC_WORKERS 0 // Threads behind the async API, 0 for one per hardware thread
+#define SCRATCH_KEEP_BYTES (1u << 20) // Thread-local scratch larger than this is freed after use
+#define SCRATCH_BLOCKS 2 // Per-thread scratch blocks for the write paths
 
 using phmap::flat_hash_map;
 
+// One entry of a writeFiles batch. The data isn't copied, it only has to stay
+// valid for the duration of the call.
+struct WriteRequest {
+	std::string fileName;
+	const char* data;
+	size_t size;
+};
+
+// Where a file's stored bytes live, for readers that map the disks themselves
+struct FileLocation {
+	size_t size = 0;
+	size_t storedSize = 0;
+	bool compressed = false;
+	bool demoted = false; // In the file tier, only readable through readFile
+	std::vector<size_t> blocks;
+	std::vector<uint64_t> versions; // Of each block at lookup, a later change means the location is stale
+};
+
+class Snapshot;
+class Transaction;
+class FileWriter;
+class FileReader;
+
 class FileSystem {
 private:
-	VirtualDisk &vdisk;
+	DiskPool pool;
 	size_t blockSize;
 	size_t totalBlocks; // Number of blocks
 	size_t diskSize; // In Bytes
 	flat_hash_map<std::string, Inode> fileTable;
-	std::bitset<MAX_NUM_FILES> bitmap;
+	std::vector<uint32_t> refCount; // Number of inodes sharing each block, 0 when free
+	uint64_t generation = 0; // Bumped by mkfs so stale snapshots don't release blocks twice
+	bool dedup = false;
+	bool verbose = true; // Report successful operations, errors are always printed
+	flat_hash_map<uint64_t, size_t> fingerprints; // Content hash -> block holding that content
+	std::vector<uint64_t> blockFingerprint; // Hash each indexed block was stored under
+	std::unique_ptr<FileTier> tier; // Where cold files spill when the disk is full
+	std::unique_ptr<TraceRecorder> trace; // Records every file operation while set
 	std::mutex mtx;
-	
+	std::shared_mutex stagingMtx; // Shared by transactions writing shadow blocks, mkfs takes it exclusively
+	std::mutex workersMtx;
+	std::unique_ptr<ThreadPool> workers; // Declared last so queued async calls finish before teardown
+
+	ThreadPool& asyncPool(); // Started by the first async call
+
+	size_t freeBlocks() { return pool.freeBlocks(); }
+
+	size_t allocateBlock(StripeCursor& cursor); // Takes a block out of a pool.reserve made by the caller
+
+	void allocateBlocks(StripeCursor& cursor, size_t count, size_t* blockIndices); // A run of them
+
+	uint8_t* scratchBlock(unsigned slot); // One of SCRATCH_BLOCKS owned by the calling thread
+
+	void retainBlock(size_t blockIndex);
+
+	void releaseBlock(size_t blockIndex, size_t* reserved = nullptr); // A block freed here is added to *reserved when given
+
+	void releaseBlocks(Inode& inode);
+
+	bool storeBlocks(Inode& inode, const char* data, size_t dataSize, StripeCursor& cursor); // Replaces the inode's stored bytes
+
+	bool storeBlocks(Inode& inode, const char* data, size_t dataSize) {
+		StripeCursor cursor = pool.startStripe();
+		return storeBlocks(inode, data, dataSize, cursor);
+	}
+
+	bool writeInode(Inode& inode, const char* data, size_t dataSize, StripeCursor& cursor); // Compresses if the inode asks for it
+
+	void freeInode(Inode& inode); // Drops the blocks and tier extent before the inode is erased
+
+	void makeRoom(size_t numBlocks, const Inode& keep); // Demotes the coldest files but keep
+
+	bool demote(Inode& inode);
+
+	bool storeInTier(Inode& inode, const char* data, size_t dataSize); // Replaces the stored bytes with a tier extent
+
+	bool promote(Inode& inode);
+
+	uint64_t hashBlock(const uint8_t* block) const;
+
+	size_t findDuplicate(const uint8_t* block, uint64_t fingerprint, uint8_t* scratch); // Returns totalBlocks on a miss
+
+	void indexBlock(size_t blockIndex, uint64_t fingerprint);
+
+	void unindexBlock(size_t blockIndex); // Must be called before a block's contents change
+
+	bool copyStored(const Inode& inode, char* dst); // storedSize raw bytes, still compressed
+
+	bool readStored(const Inode& inode, std::vector<char>& stored);
+
+	bool readInodeInto(const Inode& inode, char* dst); // inode.size bytes, caller must keep the blocks alive
+
+	bool readInode(const Inode& inode, std::vector<char>& data); // Caller must keep the blocks alive, empty on failure
+
+	void releaseSnapshot(flat_hash_map<std::string, Inode>& files, uint64_t snapshotGeneration);
+
+	void releasePinned(Inode& inode, uint64_t pinGeneration); // Drops a reference taken by openReader
+
+	bool stageBlocks(Inode& shadow, const char* data, size_t dataSize, uint64_t txGeneration); // Appends, without the filesystem lock
+
+	void discardStaged(Inode& shadow, uint64_t txGeneration);
+
+	bool commitTransaction(Transaction& tx);
+
+	bool commitWriter(FileWriter& writer);
+
+	void renameInode(const std::string& oldName, const std::string& newName); // Caller checks both names
+
+	static void printFiles(const flat_hash_map<std::string, Inode>& files, bool detailed);
+
+	friend class Snapshot;
+	friend class Transaction;
+	friend class FileWriter;
+	friend class FileReader;
 
 public:
 
 	FileSystem(VirtualDisk &vdisk);
 
+	FileSystem(const std::vector<VirtualDisk*>& disks); // Stripes blocks across every disk
+
 	void mkfs();
+
+	void setDedup(bool enabled); // Share identical blocks between writes
+
+	void setVerbose(bool enabled) { verbose = enabled; }
+
+	void trim(); // Return every fully free page of the disk to the OS now
+
+	void setVerifyOnRead(bool enabled);
+
+	bool enableTiering(const std::string& path); // Spill cold files to this file once the disk fills up
+
+	bool startTrace(const std::string& path); // Record every file operation for replay
+
+	void stopTrace(); // Flushes and closes the trace
+
+	std::vector<size_t> scrub(unsigned numThreads); // Returns corrupt blocks
 	
 	void createFile(const std::string& fileName);
 
 	bool writeFile(const std::string& fileName, const std::vector<char>& data);
 
+	bool writeFileAt(const std::string& fileName, size_t offset, const std::vector<char>& data);
+
+	bool cloneFile(const std::string& srcName, const std::string& dstName);
+
+	bool setCompression(const std::string& fileName, bool enabled); // Re-encodes the file's current contents
+
 	bool deleteFile(const std::string& fileName);
 
+	bool renameFile(const std::string& oldName, const std::string& newName); // Fails if newName exists
+
 	void readFile(const std::string& fileName, std::vector<char>& data);
 
+	// Quiet reads that copy straight from the disks into the destination. The
+	// buffer variant fails if the file is larger than capacity, size is set to
+	// the file's size either way (0 if missing) so the caller can retry. The
+	// vector variant keeps the first offset bytes of data, sizes it to fit the
+	// file behind them in one lookup and reuses its capacity.
+	bool readFileInto(const std::string& fileName, char* buffer, size_t capacity, size_t& size);
+
+	bool readFileInto(const std::string& fileName, std::vector<char>& data, size_t offset = 0);
+
 	void listFiles(bool detailed);
-};
\ No newline at end of file
+
+	std::vector<std::string> fileNames();
+
+	size_t diskCount() const { return pool.diskCount(); }
+
+	bool locateFile(const std::string& fileName, FileLocation& location); // Quiet, false if missing
+
+	std::unique_ptr<Snapshot> snapshot(); // Read-only point-in-time view of every file
+
+	std::unique_ptr<Transaction> beginTransaction(); // Stage changes to several files and commit them at once
+
+	std::unique_ptr<FileWriter> openWriter(const std::string& fileName); // Stream new contents in, visible on commit
+
+	std::unique_ptr<FileReader> openReader(const std::string& fileName); // Stream the contents out, null if missing
+
+	// Batched variants take the lock once for the whole list and report only
+	// errors. Each returns how many entries succeeded.
+	size_t createFiles(const std::vector<std::string>& fileNames);
+
+	size_t writeFiles(const std::vector<WriteRequest>& writes); // Blocks come from one shared stripe cursor
+
+	size_t deleteFiles(const std::vector<std::string>& fileNames); // Trims once at the end
+
+	size_t readFiles(const std::vector<std::string>& fileNames, std::vector<std::vector<char>>& data); // Missing files read as empty
+
+	// Asynchronous variants of the calls above. Each runs the blocking call on
+	// an internal worker pool, so arguments are taken by value.
+	std::future<void> createFileAsync(std::string fileName);
+
+	std::future<bool> writeFileAsync(std::string fileName, std::vector<char> data);
+
+	std::future<bool> writeFileAtAsync(std::string fileName, size_t offset, std::vector<char> data);
+
+	std::future<bool> deleteFileAsync(std::string fileName);
+
+	std::future<std::vector<char>> readFileAsync(std::string fileName);
+};
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include "FileTier.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+FileTier::FileTier(const std::string& path) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot create tier file " + path);
+    }
+
+    // The file only lives as long as this process holds it open
+    unlink(path.c_str());
+    io.reset(new AsyncIo(fd));
+}
+
+FileTier::~FileTier() {
+    io.reset();
+    close(fd);
+}
+
+uint64_t FileTier::allocate(uint64_t length) {
+    // First fit among the holes left by released extents, else append
+    for (auto it = freeExtents.begin(); it != freeExtents.end(); ++it) {
+        if (it->second >= length) {
+            uint64_t offset = it->first;
+            uint64_t remaining = it->second - length;
+            freeExtents.erase(it);
+            if (remaining) {
+                freeExtents.emplace(offset + length, remaining);
+            }
+            return offset;
+        }
+    }
+
+    uint64_t offset = fileEnd;
+    fileEnd += length;
+    return offset;
+}
+
+bool FileTier::store(const char* data, size_t size, uint64_t& offset) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        offset = allocate(size);
+        extents[offset] = Extent{size, 1};
+        bytesUsed += size;
+    }
+
+    if (!transfer(true, offset, const_cast<char*>(data), size)) {
+        release(offset);
+        return false;
+    }
+    return true;
+}
+
+bool FileTier::load(uint64_t offset, char* data, size_t size) {
+    return transfer(false, offset, data, size);
+}
+
+bool FileTier::transfer(bool write, uint64_t offset, char* data, size_t size) {
+    std::lock_guard<std::mutex> lock(ioMtx);
+    bool ok = true;
+    for (size_t done = 0; done < size; done += TIER_IO_CHUNK) {
+        size_t length = std::min<size_t>(TIER_IO_CHUNK, size - done);
+        auto check = [&ok, length](ssize_t result) {
+            if (result != (ssize_t)length) {
+                ok = false;
+            }
+        };
+        if (write) {
+            io->submitWrite(offset + done, data + done, length, check);
+        } else {
+            io->submitRead(offset + done, data + done, length, check);
+        }
+    }
+    io->wait();
+    return ok;
+}
+
+void FileTier::retain(uint64_t offset) {
+    std::lock_guard<std::mutex> lock(mtx);
+    ++extents.at(offset).refs;
+}
+
+void FileTier::release(uint64_t offset) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = extents.find(offset);
+    if (it == extents.end() || --it->second.refs > 0) {
+        return;
+    }
+
+    uint64_t length = it->second.length;
+    extents.erase(it);
+    bytesUsed -= length;
+    if (length == 0) {
+        return;
+    }
+
+    // Give the space back to the filesystem, then merge with free neighbours
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+
+    auto next = freeExtents.lower_bound(offset);
+    if (next != freeExtents.end() && offset + length == next->first) {
+        length += next->second;
+        next = freeExtents.erase(next);
+    }
+    if (next != freeExtents.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            length += prev->second;
+            freeExtents.erase(prev);
+        }
+    }
+
+    if (offset + length == fileEnd) {
+        fileEnd = offset;
+        ftruncate(fd, fileEnd);
+    } else {
+        freeExtents.emplace(offset, length);
+    }
+}
+
+void FileTier::reset() {
+    std::lock_guard<std::mutex> lock(mtx);
+    extents.clear();
+    freeExtents.clear();
+    fileEnd = 0;
+    bytesUsed = 0;
+    ftruncate(fd, 0);
+}
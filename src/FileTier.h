@@ -0,0 +1,54 @@
+#pragma once
+#include "../lib/parallel_hashmap/phmap.h"
+#include "AsyncIo.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#define TIER_IO_CHUNK (64 * 1024) // Extents move in pieces of this size, all in flight at once
+
+// Second storage tier backed by a local file. Each demoted file is kept as
+// one contiguous extent, reference counted so clones and snapshots can share
+// it the same way they share disk blocks.
+class FileTier {
+private:
+	struct Extent {
+		uint64_t length;
+		uint32_t refs;
+	};
+
+	int fd = -1;
+	std::mutex mtx;
+	std::mutex ioMtx; // The ring has a single submitter
+	std::unique_ptr<AsyncIo> io;
+	uint64_t fileEnd = 0; // Everything past this offset is unused
+	std::map<uint64_t, uint64_t> freeExtents; // Offset -> length, coalesced
+	phmap::flat_hash_map<uint64_t, Extent> extents; // Live extents by offset
+
+	uint64_t allocate(uint64_t length);
+
+	bool transfer(bool write, uint64_t offset, char* data, size_t size);
+
+public:
+	uint64_t bytesUsed = 0;
+
+	FileTier(const std::string& path); // Throws std::runtime_error if the file can't be created
+
+	FileTier(const FileTier&) = delete;
+
+	FileTier& operator=(const FileTier&) = delete;
+
+	~FileTier();
+
+	bool store(const char* data, size_t size, uint64_t& offset); // New extent with one reference
+
+	bool load(uint64_t offset, char* data, size_t size);
+
+	void retain(uint64_t offset);
+
+	void release(uint64_t offset);
+
+	void reset();
+};
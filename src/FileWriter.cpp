@@ -0,0 +1,108 @@
+#include "FileWriter.h"
+#include "Lz.h"
+
+FileWriter::FileWriter(FileSystem &fs, const std::string& fileName, uint64_t generation, bool compressed)
+    : fs(fs), fileName(fileName), generation(generation), compressed(compressed) {
+    tail.reserve(fs.blockSize);
+    if (compressed) {
+        frame.reserve(LZ_FRAME_SIZE);
+    }
+}
+
+FileWriter::~FileWriter() {
+    abort();
+}
+
+bool FileWriter::store(const char* data, size_t size) {
+    size_t blockSize = fs.blockSize;
+
+    // Top up the partial block left by the previous chunk first
+    if (!tail.empty()) {
+        size_t take = std::min(blockSize - tail.size(), size);
+        tail.insert(tail.end(), data, data + take);
+        data += take;
+        size -= take;
+        if (tail.size() < blockSize) {
+            return true;
+        }
+        if (!fs.stageBlocks(shadow, tail.data(), blockSize, generation)) {
+            return false;
+        }
+        tail.clear();
+    }
+
+    // Whole blocks are staged straight from the caller's chunk
+    size_t fullBytes = size / blockSize * blockSize;
+    if (fullBytes && !fs.stageBlocks(shadow, data, fullBytes, generation)) {
+        return false;
+    }
+    tail.assign(data + fullBytes, data + size);
+    return true;
+}
+
+bool FileWriter::storeFrame(const char* data, size_t size) {
+    encoded.clear();
+    lzCompressFrame(data, size, encoded);
+    return store(encoded.data(), encoded.size());
+}
+
+bool FileWriter::write(const char* data, size_t size) {
+    if (finished || failed) {
+        return false;
+    }
+    rawSize += size;
+    if (!compressed) {
+        failed = !store(data, size);
+        return !failed;
+    }
+
+    // Frames are cut where lzCompressFrames would cut them, so the stored
+    // stream doesn't depend on how the caller chunks the data
+    while (size && !failed) {
+        if (frame.empty() && size >= LZ_FRAME_SIZE) {
+            failed = !storeFrame(data, LZ_FRAME_SIZE);
+            data += LZ_FRAME_SIZE;
+            size -= LZ_FRAME_SIZE;
+            continue;
+        }
+        size_t take = std::min<size_t>(LZ_FRAME_SIZE - frame.size(), size);
+        frame.insert(frame.end(), data, data + take);
+        data += take;
+        size -= take;
+        if (frame.size() == LZ_FRAME_SIZE) {
+            failed = !storeFrame(frame.data(), frame.size());
+            frame.clear();
+        }
+    }
+    return !failed; // stageBlocks already gave back every shadow block
+}
+
+bool FileWriter::commit() {
+    if (finished || failed) {
+        return false;
+    }
+    if (!frame.empty() && !storeFrame(frame.data(), frame.size())) {
+        failed = true;
+        return false;
+    }
+    frame.clear();
+    if (!tail.empty() && !fs.stageBlocks(shadow, tail.data(), tail.size(), generation)) {
+        failed = true;
+        return false;
+    }
+    tail.clear();
+
+    if (!fs.commitWriter(*this)) {
+        return false;
+    }
+    finished = true;
+    return true;
+}
+
+void FileWriter::abort() {
+    if (finished) {
+        return;
+    }
+    fs.discardStaged(shadow, generation);
+    finished = true;
+}
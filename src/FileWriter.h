@@ -0,0 +1,48 @@
+#pragma once
+#include "FileSystem.h"
+
+// Replaces a file's contents with data that arrives in pieces. Each write()
+// goes straight into shadow blocks, without the filesystem lock, so memory use
+// stays at one block (plus one compression frame) however large the file gets.
+// Nothing is visible until commit(), which swaps the new blocks in and creates
+// the file if it doesn't exist. Shadow blocks can't spill to the file tier, a
+// full disk fails the write. An uncommitted writer is aborted by its destructor.
+class FileWriter {
+private:
+	FileSystem &fs;
+	std::string fileName;
+	uint64_t generation; // A mkfs since open invalidates the shadow blocks
+	bool compressed; // Taken from the file when opened
+	Inode shadow;
+	std::vector<char> tail; // Stored bytes short of a full block
+	std::vector<char> frame; // Raw bytes short of a full compression frame
+	std::vector<char> encoded;
+	size_t rawSize = 0;
+	bool failed = false;
+	bool finished = false;
+
+	FileWriter(FileSystem &fs, const std::string& fileName, uint64_t generation, bool compressed);
+
+	bool store(const char* data, size_t size); // Appends stored bytes, staging every full block
+
+	bool storeFrame(const char* data, size_t size); // Compresses one frame and stores it
+
+	friend class FileSystem;
+
+public:
+	FileWriter(const FileWriter&) = delete;
+
+	FileWriter& operator=(const FileWriter&) = delete;
+
+	~FileWriter();
+
+	bool write(const char* data, size_t size); // False once the disk fills up, the writer is then unusable
+
+	bool write(const std::vector<char>& chunk) { return write(chunk.data(), chunk.size()); }
+
+	bool commit(); // False leaves the file untouched
+
+	void abort();
+
+	size_t size() const { return rawSize; }
+};
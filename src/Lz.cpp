@@ -0,0 +1,217 @@
+#include "Lz.h"
+#include <algorithm>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_LOG 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hashSequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+// Writes the 255-saturated extension bytes of a length that overflowed its nibble
+static bool writeLength(size_t length, uint8_t*& op, const uint8_t* opEnd) {
+    for (; length >= 255; length -= 255) {
+        if (op >= opEnd) return false;
+        *op++ = 255;
+    }
+    if (op >= opEnd) return false;
+    *op++ = static_cast<uint8_t>(length);
+    return true;
+}
+
+static bool readLength(size_t& length, const uint8_t*& ip, const uint8_t* ipEnd) {
+    uint8_t byte;
+    do {
+        if (ip >= ipEnd) return false;
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static bool emitSequence(const uint8_t* literals, size_t literalLength, size_t offset, size_t matchLength,
+                         uint8_t*& op, const uint8_t* opEnd) {
+    if (op >= opEnd) return false;
+    uint8_t* token = op++;
+    size_t matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+    *token = static_cast<uint8_t>((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(matchCode, 15));
+
+    if (literalLength >= 15 && !writeLength(literalLength - 15, op, opEnd)) return false;
+    if (static_cast<size_t>(opEnd - op) < literalLength) return false;
+    std::memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    // The last sequence carries literals only
+    if (matchLength == 0) return true;
+
+    if (opEnd - op < 2) return false;
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    if (matchCode >= 15 && !writeLength(matchCode - 15, op, opEnd)) return false;
+    return true;
+}
+
+size_t lzCompressBound(size_t srcSize) {
+    return srcSize + srcSize / 255 + 16;
+}
+
+size_t lzCompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity) {
+    uint32_t table[1 << LZ_HASH_LOG] = {}; // Position + 1 of the last occurrence, 0 when empty
+    uint8_t* op = dst;
+    const uint8_t* opEnd = dst + dstCapacity;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    while (ip + LZ_MIN_MATCH <= srcSize) {
+        uint32_t sequence = read32(src + ip);
+        uint32_t& slot = table[hashSequence(sequence)];
+        size_t candidate = slot;
+        slot = static_cast<uint32_t>(ip + 1);
+
+        if (candidate == 0 || ip + 1 - candidate > LZ_MAX_OFFSET || read32(src + candidate - 1) != sequence) {
+            ++ip;
+            continue;
+        }
+        --candidate;
+
+        size_t matchLength = LZ_MIN_MATCH;
+        while (ip + matchLength < srcSize && src[candidate + matchLength] == src[ip + matchLength]) {
+            ++matchLength;
+        }
+
+        if (!emitSequence(src + anchor, ip - anchor, ip - candidate, matchLength, op, opEnd)) return 0;
+        ip += matchLength;
+        anchor = ip;
+    }
+
+    if (!emitSequence(src + anchor, srcSize - anchor, 0, 0, op, opEnd)) return 0;
+    return op - dst;
+}
+
+bool lzDecompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize) {
+    const uint8_t* ip = src;
+    const uint8_t* ipEnd = src + srcSize;
+    uint8_t* op = dst;
+    uint8_t* opEnd = dst + dstSize;
+
+    while (ip < ipEnd) {
+        uint8_t token = *ip++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(literalLength, ip, ipEnd)) return false;
+        if (static_cast<size_t>(ipEnd - ip) < literalLength || static_cast<size_t>(opEnd - op) < literalLength) return false;
+        std::memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        if (ip == ipEnd) break;
+
+        if (ipEnd - ip < 2) return false;
+        size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(matchLength, ip, ipEnd)) return false;
+        matchLength += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > static_cast<size_t>(op - dst) || static_cast<size_t>(opEnd - op) < matchLength) {
+            return false;
+        }
+
+        // Matches may overlap the bytes they produce, so copy forwards one at a time
+        const uint8_t* match = op - offset;
+        for (size_t i = 0; i < matchLength; ++i) {
+            op[i] = match[i];
+        }
+        op += matchLength;
+    }
+
+    return op == opEnd;
+}
+
+void lzCompressFrame(const char* data, size_t size, std::vector<char>& out) {
+    size_t headerAt = out.size();
+    out.resize(headerAt + LZ_FRAME_HEADER + size);
+
+    uint32_t rawSize = static_cast<uint32_t>(size);
+    uint32_t storedSize = static_cast<uint32_t>(lzCompress(reinterpret_cast<const uint8_t*>(data), size,
+        reinterpret_cast<uint8_t*>(out.data() + headerAt + LZ_FRAME_HEADER), size));
+
+    // Keep incompressible frames as they are
+    if (storedSize == 0) {
+        std::memcpy(out.data() + headerAt + LZ_FRAME_HEADER, data, size);
+        storedSize = rawSize | LZ_FRAME_RAW;
+        out.resize(headerAt + LZ_FRAME_HEADER + size);
+    } else {
+        out.resize(headerAt + LZ_FRAME_HEADER + storedSize);
+    }
+
+    std::memcpy(out.data() + headerAt, &rawSize, sizeof(rawSize));
+    std::memcpy(out.data() + headerAt + sizeof(rawSize), &storedSize, sizeof(storedSize));
+}
+
+void lzCompressFrames(const char* data, size_t size, std::vector<char>& out) {
+    for (size_t offset = 0; offset < size; offset += LZ_FRAME_SIZE) {
+        lzCompressFrame(data + offset, std::min<size_t>(LZ_FRAME_SIZE, size - offset), out);
+    }
+}
+
+bool lzDecompressFrames(const char* data, size_t size, std::vector<char>& out) {
+    size_t offset = 0;
+    while (offset < size) {
+        if (size - offset < LZ_FRAME_HEADER) return false;
+
+        uint32_t rawSize, storedSize;
+        std::memcpy(&rawSize, data + offset, sizeof(rawSize));
+        std::memcpy(&storedSize, data + offset + sizeof(rawSize), sizeof(storedSize));
+        offset += LZ_FRAME_HEADER;
+
+        bool raw = storedSize & LZ_FRAME_RAW;
+        storedSize &= ~LZ_FRAME_RAW;
+        if (size - offset < storedSize || (raw && storedSize != rawSize)) return false;
+
+        size_t outAt = out.size();
+        out.resize(outAt + rawSize);
+        if (raw) {
+            std::memcpy(out.data() + outAt, data + offset, rawSize);
+        } else if (!lzDecompress(reinterpret_cast<const uint8_t*>(data + offset), storedSize,
+                                 reinterpret_cast<uint8_t*>(out.data() + outAt), rawSize)) {
+            return false;
+        }
+        offset += storedSize;
+    }
+    return true;
+}
+
+bool lzDecompressFramesInto(const char* data, size_t size, char* dst, size_t dstSize) {
+    size_t offset = 0;
+    size_t outAt = 0;
+    while (offset < size) {
+        if (size - offset < LZ_FRAME_HEADER) return false;
+
+        uint32_t rawSize, storedSize;
+        std::memcpy(&rawSize, data + offset, sizeof(rawSize));
+        std::memcpy(&storedSize, data + offset + sizeof(rawSize), sizeof(storedSize));
+        offset += LZ_FRAME_HEADER;
+
+        bool raw = storedSize & LZ_FRAME_RAW;
+        storedSize &= ~LZ_FRAME_RAW;
+        if (size - offset < storedSize || (raw && storedSize != rawSize) || dstSize - outAt < rawSize) return false;
+
+        if (raw) {
+            std::memcpy(dst + outAt, data + offset, rawSize);
+        } else if (!lzDecompress(reinterpret_cast<const uint8_t*>(data + offset), storedSize,
+                                 reinterpret_cast<uint8_t*>(dst + outAt), rawSize)) {
+            return false;
+        }
+        outAt += rawSize;
+        offset += storedSize;
+    }
+    return outAt == dstSize;
+}
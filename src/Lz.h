@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// Small LZ77 codec in the LZ4 block style: a token byte holds the literal
+// run and match lengths, followed by the literals, a 16-bit match offset and
+// any length extension bytes. Compressed files are stored as a sequence of
+// independent frames so they can be produced and consumed incrementally.
+
+#define LZ_FRAME_SIZE 16384 // Raw bytes per frame
+#define LZ_FRAME_HEADER 8 // uint32 raw size + uint32 stored size
+#define LZ_FRAME_RAW 0x80000000u // Set in the stored size when the frame is kept uncompressed
+
+size_t lzCompressBound(size_t srcSize);
+
+// Returns the compressed size, or 0 if the result doesn't fit in dstCapacity
+size_t lzCompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity);
+
+// Fails unless the input decodes to exactly dstSize bytes
+bool lzDecompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize);
+
+// Appends one frame holding up to LZ_FRAME_SIZE bytes of data
+void lzCompressFrame(const char* data, size_t size, std::vector<char>& out);
+
+// Appends every frame of data, LZ_FRAME_SIZE raw bytes at a time
+void lzCompressFrames(const char* data, size_t size, std::vector<char>& out);
+
+// Appends the decoded contents of a framed stream to out
+bool lzDecompressFrames(const char* data, size_t size, std::vector<char>& out);
+
+// Decodes a framed stream into dst, fails unless it holds exactly dstSize bytes
+bool lzDecompressFramesInto(const char* data, size_t size, char* dst, size_t dstSize);
@@ -0,0 +1,244 @@
+#include "MemFsClient.h"
+#include "Lz.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+MemFsClient::MemFsClient(const std::string& socketPath) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + socketPath);
+    }
+    memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error("Cannot connect to " + socketPath);
+    }
+}
+
+MemFsClient::~MemFsClient() {
+    for (const MappedDisk& disk : disks) {
+        munmap(const_cast<uint8_t*>(disk.base), disk.size);
+    }
+    close(fd);
+}
+
+bool MemFsClient::sendAll(const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool MemFsClient::receiveAll(char* data, size_t size) {
+    while (size > 0) {
+        ssize_t got = recv(fd, data, size, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool MemFsClient::call(RequestOp op, const std::string& name, const char* payload, size_t payloadSize,
+                       uint64_t offset, std::vector<char>* response) {
+    RequestHeader request;
+    memset(&request, 0, sizeof(request));
+    request.length = name.size() + payloadSize;
+    request.id = nextId++;
+    request.offset = offset;
+    request.nameLength = name.size();
+    request.op = op;
+
+    ResponseHeader reply;
+    if (!sendAll(reinterpret_cast<const char*>(&request), sizeof(request)) || !sendAll(name.data(), name.size()) ||
+        !sendAll(payload, payloadSize) || !receiveAll(reinterpret_cast<char*>(&reply), sizeof(reply))) {
+        return false;
+    }
+
+    // The payload has to be drained even when the caller doesn't want it
+    std::vector<char> discard;
+    std::vector<char>& body = response ? *response : discard;
+    body.resize(reply.length);
+    if (!receiveAll(body.data(), reply.length)) {
+        return false;
+    }
+    return reply.status == ResponseStatus::Ok;
+}
+
+bool MemFsClient::mapShared() {
+    std::vector<char> reply;
+    if (!disks.empty() || !call(RequestOp::MapInfo, "", nullptr, 0, 0, &reply) || reply.size() < sizeof(MapInfoHeader)) {
+        return !disks.empty();
+    }
+    MapInfoHeader info;
+    memcpy(&info, reply.data(), sizeof(info));
+    std::string prefix(reply.data() + sizeof(info), reply.size() - sizeof(info));
+
+    for (uint32_t i = 0; i < info.diskCount; ++i) {
+        std::string name = prefix + "." + std::to_string(i);
+        int shmFd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        struct stat st;
+        void* base = MAP_FAILED;
+        if (shmFd >= 0 && fstat(shmFd, &st) == 0 && (size_t)st.st_size >= sizeof(SharedDiskHeader)) {
+            base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, shmFd, 0);
+        }
+        if (shmFd >= 0) {
+            close(shmFd);
+        }
+
+        const SharedDiskHeader* header = static_cast<const SharedDiskHeader*>(base);
+        if (base == MAP_FAILED || header->magic != SHARED_DISK_MAGIC || header->totalSize > (size_t)st.st_size ||
+            (blockSize && header->blockSize != blockSize)) {
+            if (base != MAP_FAILED) {
+                munmap(base, st.st_size);
+            }
+            for (const MappedDisk& disk : disks) {
+                munmap(const_cast<uint8_t*>(disk.base), disk.size);
+            }
+            disks.clear();
+            return false;
+        }
+
+        const uint8_t* bytes = static_cast<const uint8_t*>(base);
+        blockSize = header->blockSize;
+        disks.push_back(MappedDisk{bytes, (size_t)st.st_size, header->numBlocks, bytes + header->arenaOffset,
+                                   reinterpret_cast<const std::atomic<uint64_t>*>(bytes + header->versionsOffset)});
+    }
+    return !disks.empty();
+}
+
+bool MemFsClient::copyBlocks(const LocatedBlock* blocks, size_t count, char* out) {
+    size_t numDisks = disks.size();
+    for (size_t k = 0; k < count; ++k) {
+        const MappedDisk& disk = disks[blocks[k].block % numDisks];
+        size_t local = blocks[k].block / numDisks;
+        if (local >= disk.numBlocks) {
+            return false;
+        }
+
+        // Seqlock read: the block is stable if its version is even and unchanged
+        // across the copy, and current if it still matches the lookup
+        uint64_t before = disk.versions[local].load(std::memory_order_acquire);
+        if (before != blocks[k].version || (before & 1)) {
+            return false;
+        }
+        memcpy(out + k * blockSize, disk.arena + local * blockSize, blockSize);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (disk.versions[local].load(std::memory_order_relaxed) != before) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MemFsClient::readDirect(const std::string& fileName, std::vector<char>& data, bool& fallBack) {
+    std::vector<char> reply;
+    if (!call(RequestOp::Locate, fileName, nullptr, 0, 0, &reply) || reply.size() < sizeof(LocateHeader)) {
+        return false;
+    }
+    LocateHeader located;
+    memcpy(&located, reply.data(), sizeof(located));
+    if (located.demoted || reply.size() < sizeof(located) + located.blockCount * sizeof(LocatedBlock) ||
+        located.storedSize > located.blockCount * blockSize) {
+        fallBack = true;
+        return false;
+    }
+    const LocatedBlock* blocks = reinterpret_cast<const LocatedBlock*>(reply.data() + sizeof(located));
+
+    // Whole blocks are copied, so the buffer is rounded up and trimmed after
+    std::vector<char> stored;
+    std::vector<char>& target = located.compressed ? stored : data;
+    target.resize(located.blockCount * blockSize);
+    if (!copyBlocks(blocks, located.blockCount, target.data())) {
+        fallBack = true; // Raced a writer, the caller retries
+        return false;
+    }
+    target.resize(located.storedSize);
+
+    fallBack = false;
+    if (located.compressed) {
+        data.clear();
+        data.reserve(located.size);
+        return lzDecompressFrames(stored.data(), stored.size(), data);
+    }
+    return true;
+}
+
+bool MemFsClient::readFile(const std::string& fileName, std::vector<char>& data) {
+    for (int attempt = 0; isMapped() && attempt < CLIENT_READ_RETRIES; ++attempt) {
+        bool fallBack = false;
+        if (readDirect(fileName, data, fallBack)) {
+            return true;
+        }
+        if (!fallBack) {
+            return false; // The file doesn't exist
+        }
+    }
+    return call(RequestOp::Read, fileName, nullptr, 0, 0, &data);
+}
+
+bool MemFsClient::createFile(const std::string& fileName) {
+    return call(RequestOp::Create, fileName, nullptr, 0, 0, nullptr);
+}
+
+bool MemFsClient::writeFile(const std::string& fileName, const std::vector<char>& data) {
+    return call(RequestOp::Write, fileName, data.data(), data.size(), 0, nullptr);
+}
+
+bool MemFsClient::writeFileAt(const std::string& fileName, size_t offset, const std::vector<char>& data) {
+    return call(RequestOp::WriteAt, fileName, data.data(), data.size(), offset, nullptr);
+}
+
+bool MemFsClient::deleteFile(const std::string& fileName) {
+    return call(RequestOp::Delete, fileName, nullptr, 0, 0, nullptr);
+}
+
+bool MemFsClient::renameFile(const std::string& oldName, const std::string& newName) {
+    return call(RequestOp::Rename, oldName, newName.data(), newName.size(), 0, nullptr);
+}
+
+bool MemFsClient::cloneFile(const std::string& srcName, const std::string& dstName) {
+    return call(RequestOp::Clone, srcName, dstName.data(), dstName.size(), 0, nullptr);
+}
+
+std::vector<std::string> MemFsClient::listFiles() {
+    std::vector<char> reply;
+    std::vector<std::string> names;
+    if (!call(RequestOp::List, "", nullptr, 0, 0, &reply)) {
+        return names;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < reply.size(); ++i) {
+        if (reply[i] == '\n') {
+            names.emplace_back(reply.data() + start, i - start);
+            start = i + 1;
+        }
+    }
+    return names;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "Protocol.h"
+#include "VirtualDisk.h"
+#include <string>
+#include <vector>
+
+#define CLIENT_READ_RETRIES 4 // Direct reads that raced a writer before falling back to the socket
+
+// Talks to a memfs server over its Unix socket. When the server keeps its
+// disks in shared memory, mapShared() maps them read-only and readFile copies
+// blocks straight out of the arena: the server only resolves the name to a
+// block list, and the per-block versions tell whether a writer got in the way.
+// One client per thread.
+class MemFsClient {
+private:
+	struct MappedDisk {
+		const uint8_t* base;
+		size_t size;
+		uint32_t numBlocks;
+		const uint8_t* arena;
+		const std::atomic<uint64_t>* versions;
+	};
+
+	int fd = -1;
+	uint32_t nextId = 1;
+	uint32_t blockSize = 0;
+	std::vector<MappedDisk> disks;
+
+	bool call(RequestOp op, const std::string& name, const char* payload, size_t payloadSize, uint64_t offset,
+		std::vector<char>* response); // True if the server answered Ok
+
+	bool sendAll(const char* data, size_t size);
+
+	bool receiveAll(char* data, size_t size);
+
+	bool copyBlocks(const LocatedBlock* blocks, size_t count, char* out); // False if a block changed under us
+
+	bool readDirect(const std::string& fileName, std::vector<char>& data, bool& fallBack);
+
+public:
+	MemFsClient(const std::string& socketPath); // Throws std::runtime_error if the server can't be reached
+
+	MemFsClient(const MemFsClient&) = delete;
+
+	MemFsClient& operator=(const MemFsClient&) = delete;
+
+	~MemFsClient();
+
+	bool mapShared(); // False if the server's disks are not in shared memory
+
+	bool isMapped() const { return !disks.empty(); }
+
+	bool createFile(const std::string& fileName);
+
+	bool writeFile(const std::string& fileName, const std::vector<char>& data);
+
+	bool writeFileAt(const std::string& fileName, size_t offset, const std::vector<char>& data);
+
+	bool readFile(const std::string& fileName, std::vector<char>& data); // Direct from the arena when mapped
+
+	bool deleteFile(const std::string& fileName);
+
+	bool renameFile(const std::string& oldName, const std::string& newName);
+
+	bool cloneFile(const std::string& srcName, const std::string& dstName);
+
+	std::vector<std::string> listFiles();
+};
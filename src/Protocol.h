@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+
+// Wire format of the memfs socket server. Every message is a fixed header
+// followed by its variable part. Integers are in host byte order, both ends
+// run on the same machine.
+
+#define PROTOCOL_MAX_MESSAGE (256u << 20) // Largest body either side accepts
+
+enum class RequestOp : uint8_t {
+	Create = 1,
+	Write = 2, // Payload is the new contents
+	WriteAt = 3, // Payload is written at header.offset
+	Read = 4,
+	Delete = 5,
+	Rename = 6, // Payload is the new name
+	Clone = 7, // Payload is the destination name
+	List = 8, // No name, the response holds every file name separated by '\n'
+	Locate = 9, // Response is a LocateHeader followed by blockCount LocatedBlocks
+	MapInfo = 10, // Response is a MapInfoHeader followed by the shm name prefix
+};
+
+enum class ResponseStatus : uint8_t {
+	Ok = 0,
+	Failed = 1, // The filesystem refused, e.g. missing file or disk full
+	BadRequest = 2,
+};
+
+struct RequestHeader {
+	uint32_t length; // Bytes after the header: the name, then the payload
+	uint32_t id; // Echoed back so a client can pipeline requests
+	uint64_t offset;
+	uint16_t nameLength;
+	RequestOp op;
+	uint8_t reserved[5];
+};
+
+struct ResponseHeader {
+	uint32_t length; // Payload bytes after the header
+	uint32_t id;
+	ResponseStatus status;
+	uint8_t reserved[7];
+};
+
+// Lets a client that has mapped the disks copy a file straight out of the
+// arena. Block b lives on disk b % diskCount at local index b / diskCount.
+struct LocateHeader {
+	uint64_t size;
+	uint64_t storedSize;
+	uint8_t compressed; // Stored bytes are LZ frames
+	uint8_t demoted; // In the file tier, the client has to send a Read
+	uint8_t reserved[6];
+	uint64_t blockCount;
+};
+
+struct LocatedBlock {
+	uint64_t block;
+	uint64_t version; // Must still match, and be even, after the copy
+};
+
+// Disk i of a server started with --shm NAME is the shm object "NAME.i"
+struct MapInfoHeader {
+	uint32_t diskCount;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(RequestHeader) == 24, "RequestHeader is part of the wire format");
+static_assert(sizeof(ResponseHeader) == 16, "ResponseHeader is part of the wire format");
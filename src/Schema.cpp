@@ -2,4 +2,9 @@
 
 void Inode::updateModifiedTime() {
 	lastModified = std::chrono::system_clock::now();
+	lastAccessed = lastModified;
+}
+
+void Inode::updateAccessTime() {
+	lastAccessed = std::chrono::system_clock::now();
 }
\ No newline at end of file
@@ -4,16 +4,25 @@
 #include <iomanip>
 #include <sstream>
 #include <vector>
+#include "BlockList.h"
 
+// The file's name is the key of the table holding the inode, so it isn't
+// repeated here
 class Inode {
 public:
-	std::string fileName;
 	size_t size;
+	size_t storedSize; // Bytes held in dataPtr, smaller than size when compressed
+	bool compressed;
+	bool demoted; // Stored bytes live in the file tier at tierOffset instead of dataPtr
+	uint64_t tierOffset;
 	std::chrono::system_clock::time_point createdAt;
 	std::chrono::system_clock::time_point lastModified;
-	std::vector<size_t> dataPtr;
+	std::chrono::system_clock::time_point lastAccessed; // Picks which files get demoted first
+	BlockList dataPtr;
 
-	Inode(const std::string& name = "") : fileName(name), size(0), createdAt(std::chrono::system_clock::now()), lastModified(createdAt) {}
+	Inode() : size(0), storedSize(0), compressed(false), demoted(false), tierOffset(0), createdAt(std::chrono::system_clock::now()), lastModified(createdAt), lastAccessed(createdAt) {}
 
 	void updateModifiedTime();
-};
\ No newline at end of file
+
+	void updateAccessTime();
+};
\ No newline at end of file
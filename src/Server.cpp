@@ -0,0 +1,315 @@
+#include "Server.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+Server::Server(FileSystem &fs, const std::string& path, const std::string& shmName)
+    : fs(fs), path(path), shmName(shmName) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (listenFd < 0 || epollFd < 0 || wakeFd < 0) {
+        throw std::runtime_error("Cannot create server socket");
+    }
+
+    // A socket left behind by an earlier run would make bind fail
+    unlink(path.c_str());
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+        throw std::runtime_error("Cannot listen on " + path + ": " + strerror(errno));
+    }
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+}
+
+Server::~Server() {
+    for (auto& [fd, conn] : connections) {
+        close(fd);
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(path.c_str());
+    }
+    if (epollFd >= 0) {
+        close(epollFd);
+    }
+    if (wakeFd >= 0) {
+        close(wakeFd);
+    }
+}
+
+void Server::stop() {
+    uint64_t one = 1;
+    ssize_t ignored = write(wakeFd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void Server::run() {
+    std::cout << "Listening on " << path << "\n";
+    epoll_event events[SERVER_MAX_EVENTS];
+    for (;;) {
+        int ready = epoll_wait(epollFd, events, SERVER_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cout << "Error: epoll_wait failed: " << strerror(errno) << "\n";
+            return;
+        }
+
+        for (int i = 0; i < ready; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wakeFd) {
+                return;
+            }
+            if (fd == listenFd) {
+                acceptClients();
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end()) {
+                continue;
+            }
+            Connection& conn = *it->second;
+            bool open = !(events[i].events & (EPOLLERR | EPOLLHUP)) || (events[i].events & EPOLLIN);
+            if (open && (events[i].events & EPOLLIN)) {
+                open = receive(conn);
+            }
+            if (open && (events[i].events & EPOLLOUT)) {
+                open = flush(conn);
+            }
+            if (open) {
+                updateEvents(conn);
+            } else {
+                closeConnection(fd);
+            }
+        }
+    }
+}
+
+void Server::acceptClients() {
+    for (;;) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return; // EAGAIN once the backlog is drained
+        }
+        std::unique_ptr<Connection> conn(new Connection());
+        conn->fd = fd;
+        updateEvents(*conn);
+        connections.emplace(fd, std::move(conn));
+    }
+}
+
+void Server::closeConnection(int fd) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    connections.erase(fd);
+}
+
+void Server::updateEvents(Connection& conn) {
+    // Stop reading from a client that isn't collecting its responses
+    size_t unsent = conn.out.size() - conn.outStart;
+    uint32_t wanted = (unsent < SERVER_MAX_BACKLOG ? static_cast<uint32_t>(EPOLLIN) : 0u) |
+                      (unsent ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    if (wanted == conn.events) {
+        return;
+    }
+
+    epoll_event event;
+    event.events = wanted;
+    event.data.fd = conn.fd;
+    epoll_ctl(epollFd, conn.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn.fd, &event);
+    conn.events = wanted;
+}
+
+bool Server::receive(Connection& conn) {
+    // Make room for the rest of a large request in one go
+    size_t wanted = SERVER_READ_CHUNK;
+    if (conn.inEnd >= sizeof(RequestHeader)) {
+        RequestHeader header;
+        memcpy(&header, conn.in.data(), sizeof(header));
+        wanted = std::max<size_t>(wanted, sizeof(header) + header.length - conn.inEnd);
+    }
+    if (conn.in.size() - conn.inEnd < wanted) {
+        conn.in.resize(conn.inEnd + wanted);
+    }
+
+    ssize_t got = read(conn.fd, conn.in.data() + conn.inEnd, conn.in.size() - conn.inEnd);
+    if (got == 0) {
+        return false;
+    }
+    if (got < 0) {
+        return errno == EAGAIN || errno == EINTR;
+    }
+    conn.inEnd += got;
+
+    // Run every complete request, a pipelining client may have sent several
+    size_t pos = 0;
+    while (conn.inEnd - pos >= sizeof(RequestHeader)) {
+        RequestHeader header;
+        memcpy(&header, conn.in.data() + pos, sizeof(header));
+        if (header.length > PROTOCOL_MAX_MESSAGE || header.nameLength > header.length) {
+            return false; // Out of sync with the client, nothing after this can be trusted
+        }
+        if (conn.inEnd - pos - sizeof(header) < header.length) {
+            break;
+        }
+        handle(conn, header, conn.in.data() + pos + sizeof(header));
+        pos += sizeof(header) + header.length;
+    }
+
+    // Keep a partial request at the front of the buffer
+    if (pos) {
+        memmove(conn.in.data(), conn.in.data() + pos, conn.inEnd - pos);
+        conn.inEnd -= pos;
+    }
+    if (conn.inEnd == 0 && conn.in.size() > SERVER_READ_CHUNK) {
+        std::vector<char>().swap(conn.in);
+    }
+    return flush(conn);
+}
+
+bool Server::flush(Connection& conn) {
+    while (conn.outStart < conn.out.size()) {
+        ssize_t sent = send(conn.fd, conn.out.data() + conn.outStart, conn.out.size() - conn.outStart, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN;
+        }
+        conn.outStart += sent;
+    }
+    conn.out.clear();
+    conn.outStart = 0;
+    return true;
+}
+
+void Server::respond(Connection& conn, uint32_t id, ResponseStatus status, const char* data, size_t size) {
+    ResponseHeader header;
+    memset(&header, 0, sizeof(header));
+    header.length = size;
+    header.id = id;
+    header.status = status;
+    const char* raw = reinterpret_cast<const char*>(&header);
+    conn.out.insert(conn.out.end(), raw, raw + sizeof(header));
+    conn.out.insert(conn.out.end(), data, data + size);
+}
+
+void Server::handle(Connection& conn, const RequestHeader& header, const char* body) {
+    std::string name(body, header.nameLength);
+    const char* payload = body + header.nameLength;
+    size_t payloadSize = header.length - header.nameLength;
+    bool ok = false;
+
+    // The batched calls report only errors, which keeps the log quiet
+    switch (header.op) {
+    case RequestOp::Create:
+        ok = fs.createFiles({name}) == 1;
+        break;
+    case RequestOp::Write:
+        ok = fs.writeFiles({WriteRequest{name, payload, payloadSize}}) == 1;
+        break;
+    case RequestOp::WriteAt:
+        ok = fs.writeFileAt(name, header.offset, std::vector<char>(payload, payload + payloadSize));
+        break;
+    case RequestOp::Read: {
+        // The file is read straight into the output buffer behind the
+        // response header, under one lookup so a trace records one read
+        size_t headerAt = conn.out.size();
+        size_t dataAt = headerAt + sizeof(ResponseHeader);
+        if (!fs.readFileInto(name, conn.out, dataAt)) {
+            conn.out.resize(headerAt);
+            break;
+        }
+        if (conn.out.size() - dataAt > PROTOCOL_MAX_MESSAGE) {
+            // Too long for the response's length field and the client's limit
+            std::cout << "Error: " << name << " is too large to send\n";
+            conn.out.resize(headerAt);
+            break;
+        }
+        ResponseHeader response;
+        memset(&response, 0, sizeof(response));
+        response.length = conn.out.size() - dataAt;
+        response.id = header.id;
+        response.status = ResponseStatus::Ok;
+        memcpy(conn.out.data() + headerAt, &response, sizeof(response));
+        return;
+    }
+    case RequestOp::Delete:
+        ok = fs.deleteFiles({name}) == 1;
+        break;
+    case RequestOp::Rename:
+        ok = fs.renameFile(name, std::string(payload, payloadSize));
+        break;
+    case RequestOp::Clone:
+        ok = fs.cloneFile(name, std::string(payload, payloadSize));
+        break;
+    case RequestOp::List: {
+        std::string names;
+        for (const std::string& fileName : fs.fileNames()) {
+            names += fileName;
+            names += '\n';
+        }
+        respond(conn, header.id, ResponseStatus::Ok, names.data(), names.size());
+        return;
+    }
+    case RequestOp::Locate: {
+        FileLocation location;
+        if (!fs.locateFile(name, location)) {
+            break;
+        }
+        LocateHeader located;
+        memset(&located, 0, sizeof(located));
+        located.size = location.size;
+        located.storedSize = location.storedSize;
+        located.compressed = location.compressed;
+        located.demoted = location.demoted;
+        located.blockCount = location.blocks.size();
+        std::vector<char> reply(sizeof(located) + location.blocks.size() * sizeof(LocatedBlock));
+        memcpy(reply.data(), &located, sizeof(located));
+        LocatedBlock* blocks = reinterpret_cast<LocatedBlock*>(reply.data() + sizeof(located));
+        for (size_t k = 0; k < location.blocks.size(); ++k) {
+            blocks[k] = LocatedBlock{location.blocks[k], location.versions[k]};
+        }
+        respond(conn, header.id, ResponseStatus::Ok, reply.data(), reply.size());
+        return;
+    }
+    case RequestOp::MapInfo: {
+        if (shmName.empty()) {
+            break;
+        }
+        MapInfoHeader info;
+        memset(&info, 0, sizeof(info));
+        info.diskCount = fs.diskCount();
+        std::vector<char> reply(sizeof(info) + shmName.size());
+        memcpy(reply.data(), &info, sizeof(info));
+        memcpy(reply.data() + sizeof(info), shmName.data(), shmName.size());
+        respond(conn, header.id, ResponseStatus::Ok, reply.data(), reply.size());
+        return;
+    }
+    default:
+        respond(conn, header.id, ResponseStatus::BadRequest, nullptr, 0);
+        return;
+    }
+    respond(conn, header.id, ok ? ResponseStatus::Ok : ResponseStatus::Failed, nullptr, 0);
+}
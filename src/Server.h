@@ -0,0 +1,60 @@
+#pragma once
+#include "FileSystem.h"
+#include "Protocol.h"
+#include <string>
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_CHUNK (64 * 1024)
+#define SERVER_MAX_BACKLOG (8u << 20) // Unsent response bytes before a client stops being read
+
+// Serves one FileSystem to many local processes over a Unix-domain socket.
+// A single thread runs an epoll loop: each readable connection has every
+// complete request in its buffer executed in order, and the responses are
+// queued and written back as the socket accepts them, so clients can
+// pipeline without waiting for each answer.
+class Server {
+private:
+	struct Connection {
+		int fd;
+		std::vector<char> in;
+		size_t inEnd = 0; // Received bytes not yet consumed
+		std::vector<char> out;
+		size_t outStart = 0; // Response bytes already sent
+		uint32_t events = 0; // Currently registered with epoll
+	};
+
+	FileSystem &fs;
+	std::string path;
+	std::string shmName; // Prefix of the disks' shm objects, empty if they are private
+	int listenFd = -1;
+	int epollFd = -1;
+	int wakeFd = -1; // eventfd that interrupts the loop for stop()
+	flat_hash_map<int, std::unique_ptr<Connection>> connections;
+
+	void acceptClients();
+
+	bool receive(Connection& conn); // False once the connection should be closed
+
+	bool flush(Connection& conn);
+
+	void updateEvents(Connection& conn);
+
+	void handle(Connection& conn, const RequestHeader& header, const char* body);
+
+	void respond(Connection& conn, uint32_t id, ResponseStatus status, const char* data, size_t size);
+
+	void closeConnection(int fd);
+
+public:
+	Server(FileSystem &fs, const std::string& path, const std::string& shmName = ""); // Throws std::runtime_error if the socket can't be bound
+
+	Server(const Server&) = delete;
+
+	Server& operator=(const Server&) = delete;
+
+	~Server();
+
+	void run(); // Returns after stop()
+
+	void stop(); // Safe from other threads and signal handlers
+};
@@ -0,0 +1,23 @@
+#include "Snapshot.h"
+
+Snapshot::Snapshot(FileSystem &fs, const flat_hash_map<std::string, Inode>& files, uint64_t generation)
+    : fs(fs), files(files), generation(generation) {}
+
+Snapshot::~Snapshot() {
+    fs.releaseSnapshot(files, generation);
+}
+
+bool Snapshot::readFile(const std::string& fileName, std::vector<char>& data) {
+    auto it = files.find(fileName);
+    if (it == files.end()) {
+        std::cout << "File not found in snapshot!" << std::endl;
+        return false;
+    }
+
+    // No filesystem lock needed: shared blocks are never written in place
+    return fs.readInode(it->second, data);
+}
+
+void Snapshot::listFiles(bool detailed) {
+    FileSystem::printFiles(files, detailed);
+}
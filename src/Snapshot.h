@@ -0,0 +1,29 @@
+#pragma once
+#include "FileSystem.h"
+
+// A frozen, read-only image of the file table. The snapshot holds a reference
+// on every block it points at, so the live filesystem copies those blocks on
+// write and the image stays stable without blocking foreground writers.
+class Snapshot {
+private:
+	FileSystem &fs;
+	flat_hash_map<std::string, Inode> files;
+	uint64_t generation;
+
+	Snapshot(FileSystem &fs, const flat_hash_map<std::string, Inode>& files, uint64_t generation);
+
+	friend class FileSystem;
+
+public:
+	Snapshot(const Snapshot&) = delete;
+
+	Snapshot& operator=(const Snapshot&) = delete;
+
+	~Snapshot();
+
+	bool readFile(const std::string& fileName, std::vector<char>& data);
+
+	void listFiles(bool detailed);
+
+	size_t fileCount() const { return files.size(); }
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads draining one FIFO task queue. submit() hands
+// back a future for the task's result; the destructor finishes queued tasks
+// before joining.
+class ThreadPool {
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mtx;
+	std::condition_variable ready;
+	bool stopping = false;
+
+	void run();
+
+	void enqueue(std::function<void()> task);
+
+public:
+	ThreadPool(unsigned numThreads); // 0 picks one thread per hardware thread
+
+	ThreadPool(const ThreadPool&) = delete;
+
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool();
+
+	size_t size() const { return workers.size(); }
+
+	template <typename Fn>
+	auto submit(Fn fn) -> std::future<decltype(fn())> {
+		// std::function needs a copyable target, so the task is shared
+		auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::move(fn));
+		std::future<decltype(fn())> result = task->get_future();
+		enqueue([task]() { (*task)(); });
+		return result;
+	}
+};
@@ -0,0 +1,77 @@
+#include "Trace.h"
+#include <cstring>
+#include <stdexcept>
+
+TraceRecorder::TraceRecorder(const std::string& path) : start(std::chrono::steady_clock::now()) {
+    file = fopen(path.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Cannot create trace file " + path);
+    }
+    TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    fwrite(&header, sizeof(header), 1, file);
+    buffer.reserve(TRACE_BUFFER_BYTES);
+}
+
+TraceRecorder::~TraceRecorder() {
+    flush();
+    fclose(file);
+}
+
+void TraceRecorder::record(TraceOp op, const std::string& name, uint64_t offset, uint64_t size, const std::string& target) {
+    TraceRecord entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    entry.offset = offset;
+    entry.size = size;
+    entry.op = op;
+    entry.nameLength = std::min<size_t>(name.size(), UINT16_MAX);
+    entry.targetLength = std::min<size_t>(target.size(), UINT16_MAX);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    entry.thread = threadIds.try_emplace(std::this_thread::get_id(), threadIds.size()).first->second;
+    const char* raw = reinterpret_cast<const char*>(&entry);
+    buffer.insert(buffer.end(), raw, raw + sizeof(entry));
+    buffer.insert(buffer.end(), name.data(), name.data() + entry.nameLength);
+    buffer.insert(buffer.end(), target.data(), target.data() + entry.targetLength);
+    if (buffer.size() >= TRACE_BUFFER_BYTES) {
+        flushLocked();
+    }
+}
+
+void TraceRecorder::flush() {
+    std::lock_guard<std::mutex> lock(mtx);
+    flushLocked();
+}
+
+void TraceRecorder::flushLocked() {
+    fwrite(buffer.data(), 1, buffer.size(), file);
+    fflush(file);
+    buffer.clear();
+}
+
+bool loadTrace(const std::string& path, std::vector<TraceEvent>& events) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    TraceFileHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0 &&
+              header.version == TRACE_VERSION;
+    TraceEvent event;
+    while (ok && fread(&event.record, sizeof(event.record), 1, file) == 1) {
+        event.name.resize(event.record.nameLength);
+        event.target.resize(event.record.targetLength);
+        if (fread(&event.name[0], 1, event.name.size(), file) != event.name.size() ||
+            fread(&event.target[0], 1, event.target.size(), file) != event.target.size()) {
+            ok = false;
+            break;
+        }
+        events.push_back(event);
+    }
+    fclose(file);
+    return ok;
+}
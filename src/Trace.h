@@ -0,0 +1,80 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../lib/parallel_hashmap/phmap.h"
+
+#define TRACE_MAGIC "MFSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_BYTES (1u << 20) // Records are flushed to the file in chunks of this size
+
+enum class TraceOp : uint8_t {
+	Create = 1,
+	Write = 2,
+	WriteAt = 3,
+	Read = 4,
+	Delete = 5,
+	Rename = 6, // target is the new name
+	Clone = 7, // target is the destination
+	Compress = 8, // size is 1 to turn compression on, 0 to turn it off
+};
+
+struct TraceFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+// Fixed part of one record, followed by the name and then the target name.
+// Only the size of written data is kept, replays write a filler pattern.
+struct TraceRecord {
+	uint64_t timestamp; // Nanoseconds since recording started
+	uint64_t offset;
+	uint64_t size;
+	uint32_t thread; // Small id, in order of each thread's first call
+	TraceOp op;
+	uint8_t reserved;
+	uint16_t nameLength;
+	uint16_t targetLength;
+	uint8_t reserved2[6];
+};
+
+static_assert(sizeof(TraceRecord) == 40, "TraceRecord is part of the file format");
+
+struct TraceEvent {
+	TraceRecord record;
+	std::string name;
+	std::string target;
+};
+
+// Appends FileSystem calls to a binary trace file. Safe to call from any
+// thread, records are buffered and written out in large chunks.
+class TraceRecorder {
+private:
+	FILE* file;
+	std::mutex mtx;
+	std::vector<char> buffer;
+	std::chrono::steady_clock::time_point start;
+	phmap::flat_hash_map<std::thread::id, uint32_t> threadIds;
+
+	void flushLocked();
+
+public:
+	TraceRecorder(const std::string& path); // Throws std::runtime_error if the file can't be created
+
+	TraceRecorder(const TraceRecorder&) = delete;
+
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	~TraceRecorder(); // Flushes and closes the file
+
+	void record(TraceOp op, const std::string& name, uint64_t offset, uint64_t size, const std::string& target = "");
+
+	void flush();
+};
+
+bool loadTrace(const std::string& path, std::vector<TraceEvent>& events); // False if the file is missing or malformed
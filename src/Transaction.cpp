@@ -0,0 +1,51 @@
+#include "Transaction.h"
+
+Transaction::Transaction(FileSystem &fs, uint64_t generation)
+    : fs(fs), generation(generation) {}
+
+Transaction::~Transaction() {
+    abort();
+}
+
+void Transaction::createFile(const std::string& fileName) {
+    ops.push_back(Op{OpType::Create, fileName, "", Inode()});
+}
+
+bool Transaction::writeFile(const std::string& fileName, const std::vector<char>& data) {
+    Op op{OpType::Write, fileName, "", Inode()};
+    if (finished || !fs.stageBlocks(op.shadow, data.data(), data.size(), generation)) {
+        return false;
+    }
+    ops.push_back(std::move(op));
+    return true;
+}
+
+void Transaction::deleteFile(const std::string& fileName) {
+    ops.push_back(Op{OpType::Delete, fileName, "", Inode()});
+}
+
+void Transaction::renameFile(const std::string& oldName, const std::string& newName) {
+    ops.push_back(Op{OpType::Rename, oldName, newName, Inode()});
+}
+
+bool Transaction::commit() {
+    if (finished || !fs.commitTransaction(*this)) {
+        return false;
+    }
+    finished = true;
+    ops.clear();
+    return true;
+}
+
+void Transaction::abort() {
+    if (finished) {
+        return;
+    }
+    for (Op& op : ops) {
+        if (op.type == OpType::Write) {
+            fs.discardStaged(op.shadow, generation);
+        }
+    }
+    ops.clear();
+    finished = true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "FileSystem.h"
+
+// A set of creates, writes, deletes and renames that become visible together
+// on commit(). Written data goes straight into shadow blocks as it is staged,
+// without the filesystem lock, so commit only checks the staged operations
+// against the live file table and swaps block lists. A transaction that is
+// neither committed nor aborted is aborted by its destructor.
+class Transaction {
+private:
+	enum class OpType { Create, Write, Delete, Rename };
+
+	struct Op {
+		OpType type;
+		std::string fileName;
+		std::string newName; // Rename target
+		Inode shadow; // Staged contents of a write, its blocks are not yet referenced
+	};
+
+	FileSystem &fs;
+	uint64_t generation; // A mkfs since begin invalidates the shadow blocks
+	std::vector<Op> ops;
+	bool finished = false;
+
+	Transaction(FileSystem &fs, uint64_t generation);
+
+	friend class FileSystem;
+
+public:
+	Transaction(const Transaction&) = delete;
+
+	Transaction& operator=(const Transaction&) = delete;
+
+	~Transaction();
+
+	void createFile(const std::string& fileName);
+
+	bool writeFile(const std::string& fileName, const std::vector<char>& data); // False if the disk is full
+
+	void deleteFile(const std::string& fileName);
+
+	void renameFile(const std::string& oldName, const std::string& newName);
+
+	bool commit(); // All or nothing, false leaves the filesystem untouched
+
+	void abort();
+
+	size_t size() const { return ops.size(); }
+};
@@ -1,49 +1,390 @@
-#include "VirtualDisk.h"
-
-VirtualDisk::VirtualDisk()
-	: numBlocks(diskSize/blockSize)
-{
-	vdisk = new uint8_t[diskSize]();
-
-	for (size_t i = 0; i < numBlocks; ++i) {
-		block_versions[i].store(0);
-	}
-}
-
+#include "VirtualDisk.h"
+#include "Crc32c.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define HUGE_PAGE_SIZE (2u << 20)
+#define NUMA_MPOL_BIND 2
+#define NUMA_MPOL_INTERLEAVE 3
+
+// Parses /sys/devices/system/node/online ("0-3,5") into a node bit mask
+static unsigned long onlineNumaNodes()
+{
+	std::ifstream online("/sys/devices/system/node/online");
+	std::string ranges;
+	unsigned long mask = 0;
+	if (!std::getline(online, ranges)) {
+		return 1;
+	}
+
+	size_t pos = 0;
+	while (pos < ranges.size()) {
+		size_t end = ranges.find(',', pos);
+		std::string range = ranges.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+		size_t dash = range.find('-');
+		unsigned long first = std::stoul(range.substr(0, dash));
+		unsigned long last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+		for (unsigned long node = first; node <= last && node < 8 * sizeof(mask); ++node) {
+			mask |= 1ul << node;
+		}
+		if (end == std::string::npos) break;
+		pos = end + 1;
+	}
+	return mask;
+}
+
+// Anonymous mappings are zero filled by the kernel on first touch, so there is
+// no up-front memset and the NUMA policy decides where each page lands
+static uint8_t* mapArena(const VirtualDiskOptions& options, size_t& mappedSize)
+{
+	mappedSize = (mappedSize + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+	void* arena = MAP_FAILED;
+	if (options.hugeTlb) {
+		// Without MAP_NORESERVE this fails up front rather than faulting later
+		// when the hugetlbfs pool is too small
+		arena = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	if (arena == MAP_FAILED) {
+		// Fall back to regular pages, promoted to transparent huge pages below
+		arena = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	if (arena == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+
+	if (options.hugePages || options.hugeTlb) {
+		madvise(arena, mappedSize, MADV_HUGEPAGE);
+	}
+
+	if (options.numaInterleave || options.numaNode >= 0) {
+		unsigned long nodeMask = options.numaInterleave ? onlineNumaNodes() : 1ul << options.numaNode;
+		int mode = options.numaInterleave ? NUMA_MPOL_INTERLEAVE : NUMA_MPOL_BIND;
+		// Best effort: a kernel without NUMA support leaves the default policy
+		syscall(SYS_mbind, arena, mappedSize, mode, &nodeMask, 8 * sizeof(nodeMask) + 1, 0);
+	}
+
+	return static_cast<uint8_t*>(arena);
+}
+
+static size_t metadataSize(size_t bytes)
+{
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	return (bytes + pageSize - 1) / pageSize * pageSize;
+}
+
+// Per-block metadata is mapped too, so all-zero initial state costs nothing
+template <typename T>
+static T* mapZeroed(size_t count)
+{
+	void* memory = mmap(nullptr, metadataSize(count * sizeof(T)), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (memory == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+	return static_cast<T*>(memory);
+}
+
+template <typename T>
+static void unmapZeroed(T* memory, size_t count)
+{
+	munmap(memory, metadataSize(count * sizeof(T)));
+}
+
+VirtualDisk::VirtualDisk(const VirtualDiskOptions& options)
+	: blockSize(options.blockSize), diskSize(static_cast<size_t>(options.numBlocks) * options.blockSize),
+	  numBlocks(options.numBlocks)
+{
+	// Nothing is touched here: pages only become resident once written
+	shmName = options.shmName;
+	if (!shmName.empty()) {
+		mapShared();
+	} else {
+		mappedSize = diskSize;
+		vdisk = mapArena(options, mappedSize);
+		block_versions = mapZeroed<std::atomic<uint64_t>>(numBlocks);
+	}
+	blocksPerPage = std::max<size_t>(1, sysconf(_SC_PAGESIZE) / blockSize);
+#ifdef MADV_FREE
+	trimAdvice = options.lazyTrim ? MADV_FREE : MADV_DONTNEED;
+#else
+	trimAdvice = MADV_DONTNEED;
+#endif
+	checksums = mapZeroed<uint32_t>(numBlocks);
+	writtenBits = mapZeroed<std::atomic<uint64_t>>(numBlocks / 64 + 1);
+}
+
+void VirtualDisk::mapShared()
+{
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	mappedSize = metadataSize(diskSize);
+	size_t versionsOffset = pageSize + mappedSize;
+	shmSize = versionsOffset + metadataSize(numBlocks * sizeof(uint64_t));
+
+	// A fresh object is all zeros, like the anonymous arena
+	shmFd = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (shmFd < 0) {
+		throw std::runtime_error("Cannot create shared memory object " + shmName);
+	}
+	void* base = MAP_FAILED;
+	if (ftruncate(shmFd, shmSize) == 0) {
+		base = mmap(nullptr, shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+	}
+	if (base == MAP_FAILED) {
+		close(shmFd);
+		shm_unlink(shmName.c_str());
+		throw std::runtime_error("Cannot map shared memory object " + shmName);
+	}
+
+	shmBase = static_cast<uint8_t*>(base);
+	SharedDiskHeader* header = reinterpret_cast<SharedDiskHeader*>(shmBase);
+	header->blockSize = blockSize;
+	header->numBlocks = numBlocks;
+	header->arenaOffset = pageSize;
+	header->versionsOffset = versionsOffset;
+	header->totalSize = shmSize;
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = SHARED_DISK_MAGIC;
+
+	vdisk = shmBase + pageSize;
+	block_versions = reinterpret_cast<std::atomic<uint64_t>*>(shmBase + versionsOffset);
+}
+
 VirtualDisk::~VirtualDisk() 
 {
-	delete[] vdisk;
-}
-
-void VirtualDisk::readBlock(size_t blockIndex, uint8_t* buffer)
-{
+	if (shmFd >= 0) {
+		munmap(shmBase, shmSize);
+		shm_unlink(shmName.c_str());
+		close(shmFd);
+	} else {
+		munmap(vdisk, mappedSize);
+		unmapZeroed(block_versions, numBlocks);
+	}
+	unmapZeroed(checksums, numBlocks);
+	unmapZeroed(writtenBits, numBlocks / 64 + 1);
+}
+
+bool VirtualDisk::isWritten(size_t blockIndex) const
+{
+	return writtenBits[blockIndex / 64].load(std::memory_order_acquire) & (1ull << (blockIndex % 64));
+}
+
+void VirtualDisk::markWritten(size_t blockIndex)
+{
+	writtenBits[blockIndex / 64].fetch_or(1ull << (blockIndex % 64), std::memory_order_release);
+}
+
+void VirtualDisk::readBlock(size_t blockIndex, uint8_t* buffer)
+{
 	if (blockIndex >= numBlocks) {
 		throw std::out_of_range("Block index out of range");
 	}
 
+	// A block that was never written reads as zeros without faulting in its page
+	if (!isWritten(blockIndex)) {
+		std::memset(buffer, 0, blockSize);
+		return;
+	}
+
 	std::memcpy(buffer, vdisk + blockIndex * blockSize, blockSize);
-}
-
-void VirtualDisk::writeBlock(size_t blockIndex, const  uint8_t* buffer)
-{
+
+	if (verifyOnRead && crc32c(buffer, blockSize) != checksums[blockIndex]) {
+		throw std::runtime_error("Block checksum mismatch");
+	}
+}
+
+void VirtualDisk::readPartialBlock(size_t blockIndex, uint8_t* buffer, size_t length)
+{
+	if (blockIndex >= numBlocks || length > blockSize) {
+		throw std::out_of_range("Block index out of range");
+	}
+
+	if (!isWritten(blockIndex)) {
+		std::memset(buffer, 0, length);
+		return;
+	}
+
+	// The CRC covers the whole block, so check it on the disk's copy
+	const uint8_t* blockPtr = vdisk + blockIndex * blockSize;
+	if (verifyOnRead && crc32c(blockPtr, blockSize) != checksums[blockIndex]) {
+		throw std::runtime_error("Block checksum mismatch");
+	}
+	std::memcpy(buffer, blockPtr, length);
+}
+
+void VirtualDisk::writeBlock(size_t blockIndex, const  uint8_t* buffer)
+{
 	if (blockIndex >= numBlocks) {
 		throw std::out_of_range("Block index out of range");
 	}
 
 	uint8_t* blockPtr = vdisk + blockIndex * blockSize;
+	uint32_t checksum = crc32c(buffer, blockSize);
+
+	// The version is odd while the copy is in progress, so readers that map
+	// the disk from another process can tell a torn block from a stable one
+	block_versions[blockIndex].fetch_add(1, std::memory_order_acq_rel);
+	std::memcpy(blockPtr, buffer, blockSize);
+	block_versions[blockIndex].fetch_add(1, std::memory_order_release);
+
+	checksums[blockIndex] = checksum;
+	markWritten(blockIndex);
+}
+
+void VirtualDisk::writePartialBlock(size_t blockIndex, const uint8_t* buffer, size_t length)
+{
+	if (blockIndex >= numBlocks || length > blockSize) {
+		throw std::out_of_range("Block index out of range");
+	}
+
+	// Copied straight from the caller and zero padded in place, so the CRC
+	// is taken over the disk's copy
+	uint8_t* blockPtr = vdisk + blockIndex * blockSize;
+	block_versions[blockIndex].fetch_add(1, std::memory_order_acq_rel);
+	std::memcpy(blockPtr, buffer, length);
+	std::memset(blockPtr + length, 0, blockSize - length);
+	block_versions[blockIndex].fetch_add(1, std::memory_order_release);
+
+	checksums[blockIndex] = crc32c(blockPtr, blockSize);
+	markWritten(blockIndex);
+}
+
+// Length of the run of consecutive block indices starting at blockIndices[0]
+static size_t runLength(const size_t* blockIndices, size_t count)
+{
+	size_t run = 1;
+	while (run < count && blockIndices[run] == blockIndices[0] + run) {
+		++run;
+	}
+	return run;
+}
+
+void VirtualDisk::readBlocks(const size_t* blockIndices, size_t count, uint8_t* buffer)
+{
+	for (size_t i = 0; i < count; ) {
+		size_t run = runLength(blockIndices + i, count - i);
+		readBlocks(blockIndices[i], run, buffer + i * blockSize);
+		i += run;
+	}
+}
+
+void VirtualDisk::writeBlocks(const size_t* blockIndices, size_t count, const uint8_t* buffer)
+{
+	for (size_t i = 0; i < count; ) {
+		size_t run = runLength(blockIndices + i, count - i);
+		writeBlocks(blockIndices[i], run, buffer + i * blockSize);
+		i += run;
+	}
+}
 
-	while (true) {
-		// Capture the current version of the block
-		uint64_t expected_version = block_versions[blockIndex].load( std::memory_order_acquire);
+void VirtualDisk::readBlocks(size_t firstBlock, size_t count, uint8_t* buffer)
+{
+	if (firstBlock > numBlocks || count > numBlocks - firstBlock) {
+		throw std::out_of_range("Block index out of range");
+	}
 
-		// Perform the write
-		std::memcpy(blockPtr, buffer, blockSize);
+	// Copy runs of written blocks, zero fill runs of never written ones
+	for (size_t i = 0; i < count; ) {
+		bool written = isWritten(firstBlock + i);
+		size_t run = 1;
+		while (i + run < count && isWritten(firstBlock + i + run) == written) {
+			++run;
+		}
+
+		if (written) {
+			std::memcpy(buffer + i * blockSize, vdisk + (firstBlock + i) * blockSize, run * blockSize);
+		} else {
+			std::memset(buffer + i * blockSize, 0, run * blockSize);
+		}
+		i += run;
+	}
 
-		// Attempt to increment the version if it hasn't been changed
-		// by another writer. If this fails, another write happened.
-		if (block_versions[blockIndex].compare_exchange_strong(expected_version, expected_version + 1,
-			std::memory_order_acq_rel)) {
-			break;
+	if (verifyOnRead) {
+		for (size_t i = 0; i < count; ++i) {
+			if (isWritten(firstBlock + i) && crc32c(buffer + i * blockSize, blockSize) != checksums[firstBlock + i]) {
+				throw std::runtime_error("Block checksum mismatch");
+			}
 		}
-	}
-}
\ No newline at end of file
+	}
+}
+
+void VirtualDisk::writeBlocks(size_t firstBlock, size_t count, const uint8_t* buffer)
+{
+	if (firstBlock > numBlocks || count > numBlocks - firstBlock) {
+		throw std::out_of_range("Block index out of range");
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		block_versions[firstBlock + i].fetch_add(1, std::memory_order_acq_rel);
+	}
+
+	std::memcpy(vdisk + firstBlock * blockSize, buffer, count * blockSize);
+
+	for (size_t i = 0; i < count; ++i) {
+		checksums[firstBlock + i] = crc32c(buffer + i * blockSize, blockSize);
+		block_versions[firstBlock + i].fetch_add(1, std::memory_order_release);
+		markWritten(firstBlock + i);
+	}
+}
+
+void VirtualDisk::trimBlocks(size_t firstBlock, size_t count)
+{
+	if (firstBlock > numBlocks || count > numBlocks - firstBlock) {
+		throw std::out_of_range("Block index out of range");
+	}
+
+	for (size_t i = firstBlock; i < firstBlock + count; ++i) {
+		writtenBits[i / 64].fetch_and(~(1ull << (i % 64)), std::memory_order_release);
+	}
+
+	// Only pages lying entirely inside the range can be dropped
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t begin = (firstBlock * blockSize + pageSize - 1) / pageSize * pageSize;
+	size_t end = (firstBlock + count) * blockSize / pageSize * pageSize;
+	if (begin >= end) {
+		return;
+	}
+	if (shmFd < 0) {
+		madvise(vdisk + begin, end - begin, trimAdvice);
+		return;
+	}
+
+	// Shared pages are only freed by punching them out of the object. The
+	// contents change, so the versions move on for readers in other processes
+	fallocate(shmFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (vdisk - shmBase) + begin, end - begin);
+	for (size_t i = begin / blockSize; i < end / blockSize; ++i) {
+		block_versions[i].fetch_add(2, std::memory_order_release);
+	}
+}
+
+std::vector<size_t> VirtualDisk::scrub(unsigned numThreads)
+{
+	numThreads = std::max(1u, numThreads);
+	std::vector<std::vector<size_t>> corrupt(numThreads);
+	std::vector<std::thread> workers;
+
+	// Each worker checks one contiguous slice of the disk
+	size_t sliceSize = (numBlocks + numThreads - 1) / numThreads;
+	for (unsigned t = 0; t < numThreads; ++t) {
+		workers.emplace_back([this, t, sliceSize, &corrupt]() {
+			size_t end = std::min<size_t>(numBlocks, (t + 1) * sliceSize);
+			for (size_t i = t * sliceSize; i < end; ++i) {
+				if (isWritten(i) && crc32c(vdisk + i * blockSize, blockSize) != checksums[i]) {
+					corrupt[t].push_back(i);
+				}
+			}
+		});
+	}
+
+	std::vector<size_t> result;
+	for (unsigned t = 0; t < numThreads; ++t) {
+		workers[t].join();
+		result.insert(result.end(), corrupt[t].begin(), corrupt[t].end());
+	}
+	return result;
+}
\ No newline at end of file
@@ -1,25 +1,91 @@
+#pragma once
 #include <bitset>
 #include <atomic>
 #include <cstdint>
 #include <vector>
 #include <cstring>
 #include <stdexcept>
+#include <string>
+#include <thread>
 
 #define _NUM_BLOCKS 16192 // DONT USE OUTSIDE CLASS
+#define SHARED_DISK_MAGIC 0x316d6873666d656dull // "memfshm1"
+
+// First page of a disk kept in POSIX shared memory. Other processes map the
+// object read-only and find the arena and version counters from here.
+struct SharedDiskHeader {
+	uint64_t magic;
+	uint32_t blockSize;
+	uint32_t numBlocks;
+	uint64_t arenaOffset;
+	uint64_t versionsOffset;
+	uint64_t totalSize;
+};
+
+struct VirtualDiskOptions {
+	uint32_t blockSize = 128; // 128B
+	uint32_t numBlocks = _NUM_BLOCKS;
+	bool hugePages = false; // mmap the arena and ask for transparent huge pages
+	bool hugeTlb = false; // mmap from the preallocated hugetlbfs pool (MAP_HUGETLB)
+	int numaNode = -1; // Bind the arena to this NUMA node
+	bool numaInterleave = false; // Spread the arena's pages over every online node
+	bool lazyTrim = false; // Trim with MADV_FREE, which reclaims only under memory pressure
+	std::string shmName; // Put the arena and versions in this POSIX shm object, ignores the page options
+};
 
 class VirtualDisk {
 public:
 	uint8_t *vdisk = nullptr;
 	uint32_t blockSize = 128; // 128B
-	uint32_t diskSize = _NUM_BLOCKS*blockSize;
+	size_t diskSize = _NUM_BLOCKS*blockSize;
 	uint32_t numBlocks = _NUM_BLOCKS;
-	std::atomic<uint64_t> block_versions[_NUM_BLOCKS];
+	std::atomic<uint64_t> *block_versions = nullptr; // Odd while a write to the block is in progress
+	uint32_t *checksums = nullptr; // CRC32C of every block, updated by writeBlock
+	std::atomic<uint64_t> *writtenBits = nullptr; // One bit per block, clear until its first write
+	std::atomic<bool> verifyOnRead{false}; // Check the CRC in readBlock and throw on mismatch, toggled while others read
+	size_t mappedSize = 0; // Length of the mmap'd arena
+	uint32_t blocksPerPage = 1; // Smallest run of blocks that trimBlocks can hand back
+	int trimAdvice = 0;
+	std::string shmName;
+	int shmFd = -1;
+	uint8_t *shmBase = nullptr; // Whole shared object, vdisk and block_versions point into it
+	size_t shmSize = 0;
+
+	void mapShared(); // Throws std::runtime_error if the object can't be created
 
-	VirtualDisk();
+	VirtualDisk(const VirtualDiskOptions& options = VirtualDiskOptions());
+
+	VirtualDisk(const VirtualDisk&) = delete;
+
+	VirtualDisk& operator=(const VirtualDisk&) = delete;
 
 	~VirtualDisk();
 
+	bool isWritten(size_t blockIndex) const; // Unwritten blocks read as zeros
+
+	void markWritten(size_t blockIndex);
+
 	void readBlock(size_t blockIndex, uint8_t* buffer); // Reads one block and stores into the index
 
+	void readPartialBlock(size_t blockIndex, uint8_t* buffer, size_t length); // First length bytes, for the tail of a file
+
 	void writeBlock(size_t blockIndex, const uint8_t* buffer); // Write one block adn store into buffer 
-};
\ No newline at end of file
+
+	void writePartialBlock(size_t blockIndex, const uint8_t* buffer, size_t length); // Zero pads the rest of the block
+
+	// Vectored variants: block i of the list maps to buffer + i * blockSize.
+	// Runs of adjacent block indices are bounds checked and copied in one go.
+	void readBlocks(const size_t* blockIndices, size_t count, uint8_t* buffer);
+
+	void writeBlocks(const size_t* blockIndices, size_t count, const uint8_t* buffer);
+
+	void readBlocks(size_t firstBlock, size_t count, uint8_t* buffer); // Contiguous extent
+
+	void writeBlocks(size_t firstBlock, size_t count, const uint8_t* buffer); // Contiguous extent
+
+	// Forgets the contents of free blocks: they read as zeros again and any
+	// whole pages in the range are returned to the kernel
+	void trimBlocks(size_t firstBlock, size_t count);
+
+	std::vector<size_t> scrub(unsigned numThreads); // Returns the blocks whose contents no longer match their CRC
+};
\ No newline at end of file
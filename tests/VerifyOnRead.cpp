@@ -0,0 +1,77 @@
+#include "../src/FileSystem.h"
+#include "../src/FileReader.h"
+#include "../src/Snapshot.h"
+#include <cstdlib>
+
+// A block corrupted behind the filesystem's back has to fail the reads that
+// touch it, with verify on read set, instead of taking the process down
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+	if (!condition) {
+		std::cerr << "FAILED: " << what << "\n";
+		++failures;
+	}
+}
+
+int main() {
+	VirtualDiskOptions options;
+	options.numBlocks = 1024;
+	VirtualDisk disk(options);
+	FileSystem memFS(disk);
+	memFS.setVerbose(false);
+
+	std::vector<char> contents(10 * options.blockSize, 'a');
+	memFS.createFile("bad");
+	memFS.createFile("good");
+	memFS.writeFile("bad", contents);
+	memFS.writeFile("good", contents);
+
+	FileLocation location;
+	memFS.locateFile("bad", location);
+	size_t corrupt = location.blocks[3];
+	std::unique_ptr<Snapshot> snapshot = memFS.snapshot();
+	disk.vdisk[corrupt * options.blockSize + 5] ^= 1;
+	memFS.setVerifyOnRead(true);
+
+	std::vector<char> data;
+	memFS.readFile("bad", data);
+	check(data.empty(), "readFile returns nothing for a corrupt file");
+
+	size_t size = 0;
+	std::vector<char> buffer(contents.size());
+	check(!memFS.readFileInto("bad", buffer.data(), buffer.size(), size), "readFileInto into a buffer fails");
+	check(!memFS.readFileInto("bad", data), "readFileInto into a vector fails");
+
+	std::vector<std::vector<char>> batch;
+	check(memFS.readFiles({"bad", "good"}, batch) == 1, "readFiles counts only the readable file");
+	check(batch[0].empty() && batch[1] == contents, "readFiles still reads the readable file");
+
+	check(!snapshot->readFile("bad", data), "Snapshot::readFile fails");
+
+	std::unique_ptr<FileReader> reader = memFS.openReader("bad");
+	const char* view;
+	size_t viewSize;
+	size_t total = 0;
+	while (reader->next(view, viewSize)) {
+		total += viewSize;
+	}
+	check(total < contents.size(), "FileReader stops at the corrupt block");
+	reader.reset();
+
+	// A partial write to the corrupt block can't patch it and changes nothing
+	check(!memFS.writeFileAt("bad", 3 * options.blockSize + 1, std::vector<char>(4, 'b')),
+	      "writeFileAt into a corrupt block fails");
+
+	check(memFS.readFileInto("good", data) && data == contents, "Other files still read");
+
+	// Rewriting the whole file replaces the corrupt block
+	check(memFS.writeFile("bad", contents), "writeFile over a corrupt file");
+	check(memFS.readFileInto("bad", data) && data == contents, "A rewritten file reads again");
+
+	if (failures == 0) {
+		std::cout << "VerifyOnRead: all checks passed\n";
+	}
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}